@@ -1,8 +1,19 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
 #include <regex.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <pthread.h>
+#include <ctype.h>
 
 
 #define NO_FLAGS 0
@@ -10,24 +21,389 @@
 #define B_FLAG 2
 #define E_FLAG 4
 
-int mycat_process_file(const char *file_name, int flags);
-void mycat_process_stdin(int flags);
+#define INPUT_BUF_SIZE (256 * 1024)
+#define COPY_CHUNK_MAX (1 << 30)
+
+#define OUTPUT_BUF_SIZE (64 * 1024)
+#define OUTPUT_IOV_MAX 64
+#define OUTPUT_DIRECT_MIN 4096
+
+#define GREP_REGEX_WINDOW (1024 * 1024)
+#define GREP_SPLIT_MIN (16 * 1024 * 1024)
+
+#define AC_DFA_MAX (1 << 23)
+
+#define GREP_MODE_LINES 0
+#define GREP_MODE_COUNT 1
+#define GREP_MODE_FILES 2
+#define GREP_MODE_QUIET 3
+
+#define WC_LINES 1
+#define WC_WORDS 2
+#define WC_BYTES 4
+
+/*
+ * Shared I/O layer. An input is a file or stdin that can be mapped whole,
+ * read in chunks (optionally cut at line ends) or copied to a descriptor
+ * in the kernel. An output buffers small pieces, writes long pieces from
+ * the caller's memory with writev, or (fd == -1) only collects in memory.
+ */
+struct input {
+    const char *name;
+    int fd;
+    struct stat st;
+    char *map;
+    size_t map_len;
+    char *buf;
+    size_t cap;
+    size_t filled;
+    size_t pending;
+    int eof;
+};
+
+struct output {
+    int fd;
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t mark;
+    struct iovec iov[OUTPUT_IOV_MAX];
+    int iovcnt;
+};
+
+int input_open(struct input *in, const char *path);
+void input_close(struct input *in);
+int input_map(struct input *in, const char **data, size_t *len);
+ssize_t input_read(struct input *in, const char **data);
+ssize_t input_read_lines(struct input *in, const char **data);
+int input_copy(struct input *in, int out_fd);
+
+void output_init(struct output *out, int fd);
+int output_put(struct output *out, const void *data, size_t len);
+int output_put_ref(struct output *out, const void *data, size_t len);
+int output_flush(struct output *out);
+void output_free(struct output *out);
+
+int mycat_process(struct input *in, int flags, struct output *out);
 int mycat_main(int argc, char *argv[]);
 
 
-int mygrep_search_in_file(const char *pattern, const char *file_name, int multiple_files);
-void mygrep_search_in_stdin(const char *pattern);
+struct grep_matcher;
+struct grep_opts;
+int mygrep_search(const struct grep_matcher *m, const struct grep_opts *opts, const char *file_name,
+                  int nthreads, struct output *out, long *count);
 int mygrep_main(int argc, char *argv[]);
 
+int mywc_main(int argc, char *argv[]);
+int myhead_main(int argc, char *argv[]);
+int mytail_main(int argc, char *argv[]);
+
+struct applet {
+    const char *name;
+    int (*main)(int argc, char *argv[]);
+};
+
+static const struct applet applets[] = {
+    {"mycat", mycat_main},
+    {"mygrep", mygrep_main},
+    {"mywc", mywc_main},
+    {"myhead", myhead_main},
+    {"mytail", mytail_main},
+};
+
+#define NUM_APPLETS (int)(sizeof(applets) / sizeof(applets[0]))
+
 int main(int argc, char *argv[]) {
-    if (strstr(argv[0], "mycat")) {
-        return mycat_main(argc, argv);
-    } else if (strstr(argv[0], "mygrep")) {
-        return mygrep_main(argc, argv);
+    const char *base = strrchr(argv[0], '/');
+    base = base ? base + 1 : argv[0];
+
+    for (int i = 0; i < NUM_APPLETS; i++) {
+        if (strstr(base, applets[i].name)) {
+            return applets[i].main(argc, argv);
+        }
+    }
+
+    /* multicall form: ./mycat mywc file.txt */
+    if (argc > 1) {
+        for (int i = 0; i < NUM_APPLETS; i++) {
+            if (strcmp(argv[1], applets[i].name) == 0) {
+                return applets[i].main(argc - 1, argv + 1);
+            }
+        }
+    }
+
+    fprintf(stderr, "Executable must be named after one of the applets:");
+    for (int i = 0; i < NUM_APPLETS; i++) {
+        fprintf(stderr, " %s", applets[i].name);
+    }
+    fprintf(stderr, "\n");
+    return 1;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t w = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+/* path == NULL or "-" means stdin; returns -1 with errno set on failure */
+int input_open(struct input *in, const char *path) {
+    memset(in, 0, sizeof(*in));
+    if (path == NULL || strcmp(path, "-") == 0) {
+        in->name = "(standard input)";
+        in->fd = STDIN_FILENO;
     } else {
-        fprintf(stderr, "Executable must be named 'mycat' or 'mygrep'\n");
-        return 1;
+        in->name = path;
+        in->fd = open(path, O_RDONLY);
+        if (in->fd == -1) return -1;
+    }
+    if (fstat(in->fd, &in->st) == -1) {
+        int err = errno;
+        input_close(in);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void input_close(struct input *in) {
+    if (in->map != NULL) munmap(in->map, in->map_len);
+    free(in->buf);
+    if (in->fd > STDIN_FILENO) close(in->fd);
+    in->map = NULL;
+    in->buf = NULL;
+    in->fd = -1;
+}
+
+/* Maps a non-empty regular file whole; -1 means use the read functions instead */
+int input_map(struct input *in, const char **data, size_t *len) {
+    if (in->map == NULL) {
+        if (!S_ISREG(in->st.st_mode) || in->st.st_size <= 0) return -1;
+        char *map = mmap(NULL, (size_t)in->st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        if (map == MAP_FAILED) return -1;
+        madvise(map, (size_t)in->st.st_size, MADV_SEQUENTIAL);
+        in->map = map;
+        in->map_len = (size_t)in->st.st_size;
+    }
+    *data = in->map;
+    *len = in->map_len;
+    return 0;
+}
+
+static int input_grow(struct input *in) {
+    if (in->buf == NULL) {
+        long page = sysconf(_SC_PAGESIZE);
+        if (posix_memalign((void **)&in->buf, page > 0 ? (size_t)page : 4096, INPUT_BUF_SIZE) != 0) {
+            in->buf = NULL;
+            errno = ENOMEM;
+            return -1;
+        }
+        in->cap = INPUT_BUF_SIZE;
+        return 0;
+    }
+    char *grown = realloc(in->buf, in->cap * 2);
+    if (grown == NULL) return -1;
+    in->buf = grown;
+    in->cap *= 2;
+    return 0;
+}
+
+/* Next chunk of input, valid until the next call; 0 at end, -1 on error */
+ssize_t input_read(struct input *in, const char **data) {
+    ssize_t n;
+    if (in->buf == NULL && input_grow(in) == -1) return -1;
+    do {
+        n = read(in->fd, in->buf, in->cap);
+    } while (n == -1 && errno == EINTR);
+    *data = in->buf;
+    return n;
+}
+
+/*
+ * Like input_read, but the chunk always ends at a newline: a partial last
+ * line is carried over to the next call. Only the final chunk may be
+ * unterminated.
+ */
+ssize_t input_read_lines(struct input *in, const char **data) {
+    if (in->pending > 0) {
+        memmove(in->buf, in->buf + in->pending, in->filled - in->pending);
+        in->filled -= in->pending;
+        in->pending = 0;
+    }
+
+    for (;;) {
+        if (in->eof) {
+            *data = in->buf;
+            in->pending = in->filled;
+            return (ssize_t)in->filled;
+        }
+        if (in->filled == in->cap && input_grow(in) == -1) return -1;
+
+        ssize_t n = read(in->fd, in->buf + in->filled, in->cap - in->filled);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            in->eof = 1;
+            continue;
+        }
+
+        const char *last_nl = memrchr(in->buf + in->filled, '\n', (size_t)n);
+        in->filled += (size_t)n;
+        if (last_nl != NULL) {
+            *data = in->buf;
+            in->pending = (size_t)(last_nl - in->buf) + 1;
+            return (ssize_t)in->pending;
+        }
+    }
+}
+
+/* Kernel-side copy failed before moving any data: try the next method */
+static int copy_unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EBADF
+        || err == EOPNOTSUPP || err == ESPIPE;
+}
+
+/*
+ * Copies the rest of the input to out_fd without going through user space
+ * when possible: copy_file_range, then sendfile, then splice, and finally
+ * large page-aligned read/write blocks.
+ */
+int input_copy(struct input *in, int out_fd) {
+    struct stat out_st;
+    ssize_t n;
+
+    if (fstat(out_fd, &out_st) == -1) return -1;
+
+    if (S_ISREG(in->st.st_mode)) {
+        if (S_ISREG(out_st.st_mode)) {
+            int copied = 0;
+            while ((n = copy_file_range(in->fd, NULL, out_fd, NULL, COPY_CHUNK_MAX, 0)) > 0) {
+                copied = 1;
+            }
+            if (n == 0) return 0;
+            if (copied || !copy_unsupported(errno)) return -1;
+        }
+
+        int copied = 0;
+        while ((n = sendfile(out_fd, in->fd, NULL, COPY_CHUNK_MAX)) > 0 || (n == -1 && errno == EINTR)) {
+            if (n > 0) copied = 1;
+        }
+        if (n == 0) return 0;
+        if (copied || !copy_unsupported(errno)) return -1;
+    }
+
+    if (S_ISFIFO(in->st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+        int copied = 0;
+        while ((n = splice(in->fd, NULL, out_fd, NULL, COPY_CHUNK_MAX, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0
+               || (n == -1 && errno == EINTR)) {
+            if (n > 0) copied = 1;
+        }
+        if (n == 0) return 0;
+        if (copied || !copy_unsupported(errno)) return -1;
+    }
+
+    const char *data;
+    while ((n = input_read(in, &data)) > 0) {
+        if (write_all(out_fd, data, (size_t)n) == -1) return -1;
+    }
+    return n == 0 ? 0 : -1;
+}
+
+void output_init(struct output *out, int fd) {
+    memset(out, 0, sizeof(*out));
+    out->fd = fd;
+}
+
+static void output_seal(struct output *out) {
+    if (out->len > out->mark) {
+        out->iov[out->iovcnt].iov_base = out->data + out->mark;
+        out->iov[out->iovcnt].iov_len = out->len - out->mark;
+        out->iovcnt++;
+        out->mark = out->len;
+    }
+}
+
+/* Writes everything pending; a memory-only output keeps its data */
+int output_flush(struct output *out) {
+    if (out->fd == -1) return 0;
+    output_seal(out);
+    int rc = writev_all(out->fd, out->iov, out->iovcnt);
+    out->iovcnt = 0;
+    out->len = out->mark = 0;
+    return rc;
+}
+
+int output_put(struct output *out, const void *data, size_t len) {
+    if (out->fd != -1) {
+        if (len > OUTPUT_BUF_SIZE) {
+            return output_put_ref(out, data, len) == -1 ? -1 : output_flush(out);
+        }
+        if (len > out->cap - out->len && output_flush(out) == -1) return -1;
+        if (out->data == NULL) {
+            out->data = malloc(OUTPUT_BUF_SIZE);
+            if (out->data == NULL) return -1;
+            out->cap = OUTPUT_BUF_SIZE;
+        }
+    } else if (out->len + len > out->cap) {
+        size_t new_cap = out->cap ? out->cap : 4096;
+        while (new_cap < out->len + len) new_cap *= 2;
+        char *new_data = realloc(out->data, new_cap);
+        if (new_data == NULL) return -1;
+        out->data = new_data;
+        out->cap = new_cap;
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return 0;
+}
+
+/* Long pieces are referenced, not copied: data must stay valid until output_flush */
+int output_put_ref(struct output *out, const void *data, size_t len) {
+    if (out->fd == -1 || len < OUTPUT_DIRECT_MIN) {
+        return output_put(out, data, len);
     }
+    if (out->iovcnt >= OUTPUT_IOV_MAX - 2 && output_flush(out) == -1) return -1;
+    output_seal(out);
+    out->iov[out->iovcnt].iov_base = (void *)data;
+    out->iov[out->iovcnt].iov_len = len;
+    out->iovcnt++;
+    return 0;
+}
+
+void output_free(struct output *out) {
+    free(out->data);
+    out->data = NULL;
+    out->len = out->cap = out->mark = 0;
+    out->iovcnt = 0;
 }
 
 int mycat_main(int argc, char *argv[]) {
@@ -60,156 +436,1626 @@ int mycat_main(int argc, char *argv[]) {
         }
     }
 
-    if (optind == argc) {
-        mycat_process_stdin(flags);
-    } else {
-        for (int i = optind; i < argc; i++) {
-            exit_status |= mycat_process_file(argv[i], flags);
+    struct output out;
+    output_init(&out, STDOUT_FILENO);
+
+    char *stdin_only[] = { NULL };
+    char **files = (optind == argc) ? stdin_only : &argv[optind];
+    int nfiles = (optind == argc) ? 1 : argc - optind;
+
+    for (int i = 0; i < nfiles; i++) {
+        struct input in;
+        if (input_open(&in, files[i]) == -1) {
+            perror(files[i] ? files[i] : "stdin");
+            exit_status = 1;
+            continue;
         }
+        exit_status |= mycat_process(&in, flags, &out);
+        input_close(&in);
     }
 
+    output_free(&out);
     return exit_status;
 }
 
-int mycat_process_file(const char *file_name, int flags) {
-    FILE *file = fopen(file_name, "r");
-    if (file == NULL) {
-        perror(file_name);
+/* Decimal line counter kept as text and incremented in place, "%6d\t" layout */
+struct line_counter {
+    char buf[24];
+    char *first;
+};
+
+static void lc_init(struct line_counter *lc) {
+    memset(lc->buf, ' ', sizeof(lc->buf));
+    lc->buf[sizeof(lc->buf) - 1] = '\t';
+    lc->first = &lc->buf[sizeof(lc->buf) - 2];
+    *lc->first = '1';
+}
+
+static void lc_increment(struct line_counter *lc) {
+    char *p = &lc->buf[sizeof(lc->buf) - 2];
+    while (*p == '9') {
+        *p-- = '0';
+    }
+    if (*p == ' ') {
+        *p = '1';
+        lc->first = p;
+    } else {
+        (*p)++;
+    }
+}
+
+static int lc_put(struct output *out, struct line_counter *lc) {
+    char *tab = &lc->buf[sizeof(lc->buf) - 1];
+    char *start = (tab - lc->first > 6) ? lc->first : tab - 6;
+    int rc = output_put(out, start, (size_t)(tab - start) + 1);
+    lc_increment(lc);
+    return rc;
+}
+
+/*
+ * Without flags the input is copied in the kernel where possible. With
+ * -n, -b or -E newlines are located with memchr over large read chunks; a
+ * line that crosses a chunk boundary simply continues in the next one.
+ */
+int mycat_process(struct input *in, int flags, struct output *out) {
+    if (flags == NO_FLAGS) {
+        if (output_flush(out) == -1 || input_copy(in, out->fd) == -1) {
+            perror(in->name);
+            return 1;
+        }
+        return 0;
+    }
+
+    struct line_counter lc;
+    lc_init(&lc);
+
+    int number_all = (flags & N_FLAG) && !(flags & B_FLAG);
+    int show_ends = (flags & E_FLAG) != 0;
+    int at_line_start = 1;
+    int failed = 0;
+    const char *buf;
+    ssize_t n;
+
+    while ((n = input_read(in, &buf)) > 0) {
+        const char *p = buf;
+        const char *end = buf + n;
+        while (p < end && !failed) {
+            if (at_line_start) {
+                int is_empty = (*p == '\n');
+                if (number_all || ((flags & B_FLAG) && !is_empty)) {
+                    if (lc_put(out, &lc) == -1) failed = 1;
+                }
+                at_line_start = 0;
+            }
+
+            const char *nl = memchr(p, '\n', (size_t)(end - p));
+            if (nl == NULL) {
+                if (output_put_ref(out, p, (size_t)(end - p)) == -1) failed = 1;
+                p = end;
+            } else if (show_ends) {
+                if (output_put_ref(out, p, (size_t)(nl - p)) == -1 || output_put(out, "$\n", 2) == -1) failed = 1;
+                p = nl + 1;
+                at_line_start = 1;
+            } else {
+                if (output_put_ref(out, p, (size_t)(nl - p) + 1) == -1) failed = 1;
+                p = nl + 1;
+                at_line_start = 1;
+            }
+        }
+
+        /* pieces may point into the input chunk, drain them before the next read */
+        if (failed || output_flush(out) == -1) {
+            perror("write");
+            return 1;
+        }
+    }
+    if (n == -1) {
+        perror(in->name);
         return 1;
     }
 
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
-    int line_number = 1;
+    if (!at_line_start && show_ends) {
+        if (output_put(out, "$\n", 2) == -1 || output_flush(out) == -1) {
+            perror("write");
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    while ((read = getline(&line, &len, file)) != -1) {
-        int is_empty = (line[0] == '\n');
+/*
+ * Aho-Corasick automaton over the literal patterns. Nodes are numbered in
+ * trie (DFS) order, the children of each node are one contiguous, sorted
+ * run in labels/targets. The root has a dense 256-entry table since every
+ * byte of the input passes through it. When it fits, the failure links are
+ * also folded into a full DFA over byte classes (bytes that occur in no
+ * pattern share class 0), so the scan is one table lookup per byte.
+ */
+struct ac_automaton {
+    int nnodes;
+    int nclasses;
+    unsigned char classes[256];
+    int *delta;
+    int *first_edge;
+    unsigned char *labels;
+    int *targets;
+    int *fail;
+    unsigned char *out;
+    int root_next[256];
+};
 
-        if ((flags & B_FLAG) && !is_empty) {
-            printf("%6d\t", line_number++);
-        } else if ((flags & N_FLAG) && !(flags & B_FLAG)) {
-            printf("%6d\t", line_number++);
+static int ac_child(const struct ac_automaton *ac, int s, unsigned char c) {
+    int lo = ac->first_edge[s];
+    int hi = ac->first_edge[s + 1];
+    if (hi - lo <= 8) {
+        for (int i = lo; i < hi; i++) {
+            if (ac->labels[i] == c) return ac->targets[i];
         }
+        return -1;
+    }
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ac->labels[mid] < c) lo = mid + 1;
+        else hi = mid;
+    }
+    return (lo < ac->first_edge[s + 1] && ac->labels[lo] == c) ? ac->targets[lo] : -1;
+}
 
-        if (flags & E_FLAG) {
-            if (line[read - 1] == '\n') {
-                line[read - 1] = '$';
-                printf("%s\n", line);
-            } else {
-                printf("%s$\n", line);
+static int ac_compare(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static void ac_free(struct ac_automaton *ac) {
+    if (ac == NULL) return;
+    free(ac->first_edge);
+    free(ac->labels);
+    free(ac->targets);
+    free(ac->fail);
+    free(ac->out);
+    free(ac->delta);
+    free(ac);
+}
+
+/* words must be non-empty and contain no '\n'; the array gets sorted */
+static struct ac_automaton *ac_build(char **words, int nwords) {
+    size_t total = 1;
+    for (int i = 0; i < nwords; i++) {
+        total += strlen(words[i]);
+    }
+    qsort(words, nwords, sizeof(char *), ac_compare);
+
+    struct ac_automaton *ac = calloc(1, sizeof(*ac));
+    if (ac != NULL) ac->nclasses = 1;
+    int *parent = malloc(total * sizeof(int));
+    unsigned char *label = malloc(total);
+    int *path = malloc(total * sizeof(int));
+    int *queue = malloc(total * sizeof(int));
+    if (ac == NULL || parent == NULL || label == NULL || path == NULL || queue == NULL) goto fail;
+    ac->out = calloc(total, 1);
+    ac->fail = calloc(total, sizeof(int));
+    ac->first_edge = calloc(total + 1, sizeof(int));
+    ac->labels = malloc(total);
+    ac->targets = malloc(total * sizeof(int));
+    if (ac->out == NULL || ac->fail == NULL || ac->first_edge == NULL
+        || ac->labels == NULL || ac->targets == NULL) goto fail;
+
+    /* Sorted input: a word shares a path with its predecessor up to their common prefix */
+    const char *prev = "";
+    path[0] = 0;
+    ac->nnodes = 1;
+    for (int i = 0; i < nwords; i++) {
+        const char *w = words[i];
+        size_t lcp = 0;
+        while (prev[lcp] && prev[lcp] == w[lcp]) lcp++;
+        for (size_t d = lcp; w[d]; d++) {
+            int node = ac->nnodes++;
+            parent[node] = path[d];
+            label[node] = (unsigned char)w[d];
+            path[d + 1] = node;
+        }
+        ac->out[path[strlen(w)]] = 1;
+        prev = w;
+    }
+
+    /* Children were created in label order, bucket them by parent */
+    for (int node = 1; node < ac->nnodes; node++) {
+        ac->first_edge[parent[node] + 1]++;
+    }
+    for (int s = 0; s < ac->nnodes; s++) {
+        ac->first_edge[s + 1] += ac->first_edge[s];
+    }
+    int *fill = queue;
+    memcpy(fill, ac->first_edge, ac->nnodes * sizeof(int));
+    for (int node = 1; node < ac->nnodes; node++) {
+        int e = fill[parent[node]]++;
+        ac->labels[e] = label[node];
+        ac->targets[e] = node;
+    }
+
+    /* Failure links in BFS order; out is inherited along them */
+    int head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        ac->root_next[c] = 0;
+    }
+    for (int e = ac->first_edge[0]; e < ac->first_edge[1]; e++) {
+        ac->root_next[ac->labels[e]] = ac->targets[e];
+        ac->fail[ac->targets[e]] = 0;
+        queue[tail++] = ac->targets[e];
+    }
+    while (head < tail) {
+        int u = queue[head++];
+        for (int e = ac->first_edge[u]; e < ac->first_edge[u + 1]; e++) {
+            int v = ac->targets[e];
+            unsigned char c = ac->labels[e];
+            int f = ac->fail[u];
+            int t;
+            while (f != 0 && (t = ac_child(ac, f, c)) < 0) {
+                f = ac->fail[f];
+            }
+            ac->fail[v] = (f == 0) ? ac->root_next[c] : t;
+            ac->out[v] |= ac->out[ac->fail[v]];
+            queue[tail++] = v;
+        }
+    }
+
+    for (int e = 0; e < ac->first_edge[ac->nnodes]; e++) {
+        if (ac->classes[ac->labels[e]] == 0) {
+            ac->classes[ac->labels[e]] = (unsigned char)ac->nclasses++;
+        }
+    }
+    ac->nclasses++;
+    if ((size_t)ac->nnodes * ac->nclasses <= AC_DFA_MAX) {
+        ac->delta = malloc((size_t)ac->nnodes * ac->nclasses * sizeof(int));
+    }
+    if (ac->delta != NULL) {
+        int nc = ac->nclasses;
+        for (int c = 0; c < 256; c++) {
+            ac->delta[ac->classes[c]] = ac->root_next[c];
+        }
+        /* BFS order: the failure target of a node is always filled in before it */
+        for (int i = 0; i < tail; i++) {
+            int v = queue[i];
+            int *row = &ac->delta[(size_t)v * nc];
+            memcpy(row, &ac->delta[(size_t)ac->fail[v] * nc], nc * sizeof(int));
+            for (int e = ac->first_edge[v]; e < ac->first_edge[v + 1]; e++) {
+                row[ac->classes[ac->labels[e]]] = ac->targets[e];
+            }
+        }
+    }
+
+    free(parent);
+    free(label);
+    free(path);
+    free(queue);
+    return ac;
+
+fail:
+    free(parent);
+    free(label);
+    free(path);
+    free(queue);
+    ac_free(ac);
+    return NULL;
+}
+
+/* Position of the last byte of the first literal occurrence, or NULL */
+static const char *ac_find(const struct ac_automaton *ac, const char *p, const char *end) {
+    int s = 0;
+    if (ac->delta != NULL) {
+        const int *delta = ac->delta;
+        int nc = ac->nclasses;
+        while (p < end) {
+            if (s == 0) {
+                while (p < end && ac->root_next[(unsigned char)*p] == 0) p++;
+                if (p == end) break;
+            }
+            s = delta[(size_t)s * nc + ac->classes[(unsigned char)*p]];
+            if (ac->out[s]) return p;
+            p++;
+        }
+        return NULL;
+    }
+    while (p < end) {
+        if (s == 0) {
+            while (p < end && ac->root_next[(unsigned char)*p] == 0) p++;
+            if (p == end) break;
+            s = ac->root_next[(unsigned char)*p];
+        } else {
+            unsigned char c = (unsigned char)*p;
+            int t;
+            while (s != 0 && (t = ac_child(ac, s, c)) < 0) {
+                s = ac->fail[s];
+            }
+            s = (s == 0) ? ac->root_next[c] : t;
+        }
+        if (ac->out[s]) return p;
+        p++;
+    }
+    return NULL;
+}
+
+/*
+ * Compiled pattern set. Plain-string patterns go to the Aho-Corasick
+ * automaton, the rest are joined into one alternation for regexec, or
+ * compiled one by one when a back-reference would be renumbered. When a
+ * single pattern uses the regex side, a literal is kept to avoid regexec:
+ * the whole pattern when it has no metacharacters, otherwise the longest
+ * run of characters every match must contain (NULL if none).
+ */
+struct grep_matcher {
+    int match_all;
+    struct ac_automaton *ac;
+    int use_regex;
+    regex_t *regex;
+    int nregex;
+    int is_literal;
+    char *literal;
+    size_t literal_len;
+    size_t rare_index;
+};
+
+/* Rough guess of how uncommon a byte is in text, higher is rarer */
+static int grep_byte_rarity(unsigned char c) {
+    if (c == ' ' || strchr("etaoinshr", c)) return 0;
+    if (islower(c)) return 1;
+    if (isdigit(c) || isupper(c)) return 2;
+    if (ispunct(c)) return 3;
+    return 4;
+}
+
+static const char *grep_skip_bracket(const char *p) {
+    p++;
+    if (*p == '^') p++;
+    if (*p == ']') p++;
+    while (*p && *p != ']') {
+        if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            char close = p[1];
+            p += 2;
+            while (*p && !(*p == close && p[1] == ']')) p++;
+            if (*p) p += 2;
+            continue;
+        }
+        p++;
+    }
+    return *p ? p + 1 : p;
+}
+
+static const char *grep_skip_group(const char *p) {
+    int depth = 0;
+    while (*p) {
+        if (*p == '\\' && p[1]) {
+            p += 2;
+            continue;
+        }
+        if (*p == '[') {
+            p = grep_skip_bracket(p);
+            continue;
+        }
+        if (*p == '(') depth++;
+        if (*p == ')' && --depth == 0) return p + 1;
+        p++;
+    }
+    return p;
+}
+
+/*
+ * Returns the pattern's literal (escapes resolved) and sets *is_literal
+ * when the pattern is nothing but that string; otherwise returns its
+ * longest required run of characters, or NULL when there is none.
+ */
+static char *grep_literal_of(const char *pattern, size_t *len, int *is_literal_out) {
+    size_t plen = strlen(pattern);
+    char *cur = malloc(plen + 1);
+    char *best = malloc(plen + 1);
+    size_t cur_len = 0, best_len = 0;
+    int is_literal = 1;
+    const char *p = pattern;
+
+    *len = 0;
+    *is_literal_out = 0;
+    if (cur == NULL || best == NULL) {
+        free(cur);
+        free(best);
+        return NULL;
+    }
+
+    while (*p) {
+        char ch;
+        const char *next;
+
+        if (*p == '\\' && p[1] != '\0' && !isalnum((unsigned char)p[1])) {
+            ch = p[1];
+            next = p + 2;
+        } else if (strchr("\\.[()^$|*+?{}", *p)) {
+            is_literal = 0;
+            if (*p == '|') {
+                /* top-level alternation: no single factor is required */
+                best_len = 0;
+                break;
             }
+            if (*p == '[') next = grep_skip_bracket(p);
+            else if (*p == '(') next = grep_skip_group(p);
+            else if (*p == '{' && strchr(p, '}')) next = strchr(p, '}') + 1;
+            else if (*p == '\\') next = p[1] ? p + 2 : p + 1;
+            else next = p + 1;
+
+            if (cur_len > best_len) {
+                memcpy(best, cur, cur_len);
+                best_len = cur_len;
+            }
+            cur_len = 0;
+            p = next;
+            continue;
         } else {
-            printf("%s", line);
+            ch = *p;
+            next = p + 1;
+        }
+
+        /* an atom under *, ? or {} may be absent; under + it ends the run */
+        int optional = (*next == '*' || *next == '?' || *next == '{');
+        if (!optional) cur[cur_len++] = ch;
+        if (optional || *next == '+') {
+            if (cur_len > best_len) {
+                memcpy(best, cur, cur_len);
+                best_len = cur_len;
+            }
+            cur_len = 0;
         }
+        p = next;
+    }
+    if (*p == '\0' && cur_len > best_len) {
+        memcpy(best, cur, cur_len);
+        best_len = cur_len;
+    }
+    free(cur);
+
+    *is_literal_out = is_literal;
+    if (is_literal || best_len > 0) {
+        best[best_len] = '\0';
+        *len = best_len;
+        return best;
     }
+    free(best);
+    return NULL;
+}
+
+void grep_matcher_free(struct grep_matcher *m) {
+    for (int i = 0; i < m->nregex; i++) {
+        regfree(&m->regex[i]);
+    }
+    free(m->regex);
+    ac_free(m->ac);
+    free(m->literal);
+}
 
-    free(line);
-    fclose(file);
+/* \1..\9 refer to groups by number, so such a pattern can't be wrapped */
+static int grep_has_backref(const char *pattern) {
+    for (const char *p = pattern; *p; p++) {
+        if (*p != '\\') continue;
+        if (p[1] >= '1' && p[1] <= '9') return 1;
+        if (p[1] != '\0') p++;
+    }
     return 0;
 }
 
-void mycat_process_stdin(int flags) {
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
-    int line_number = 1;
+int grep_matcher_compile(struct grep_matcher *m, char **patterns, int npatterns) {
+    char **words = malloc((npatterns + 1) * sizeof(char *));
+    char **regexes = malloc((npatterns + 1) * sizeof(char *));
+    int nwords = 0, nregexes = 0;
+    int rc = -1;
 
-    while ((read = getline(&line, &len, stdin)) != -1) {
-        int is_empty = (line[0] == '\n');
+    memset(m, 0, sizeof(*m));
+    if (words == NULL || regexes == NULL) goto out;
 
-        if ((flags & B_FLAG) && !is_empty) {
-            printf("%6d\t", line_number++);
-        } else if ((flags & N_FLAG) && !(flags & B_FLAG)) {
-            printf("%6d\t", line_number++);
+    for (int i = 0; i < npatterns; i++) {
+        size_t len;
+        int is_literal;
+        char *lit = grep_literal_of(patterns[i], &len, &is_literal);
+        if (is_literal && lit != NULL && len > 0) {
+            words[nwords++] = lit;
+        } else if (is_literal && lit != NULL && len == 0) {
+            /* the empty pattern selects every line */
+            m->match_all = 1;
+            free(lit);
+        } else {
+            free(lit);
+            regexes[nregexes++] = patterns[i];
         }
+    }
 
-        if (flags & E_FLAG) {
-            if (line[read - 1] == '\n') {
-                line[read - 1] = '$';
-                printf("%s\n", line);
-            } else {
-                printf("%s$\n", line);
+    if (nregexes == 0 && nwords == 1) {
+        m->use_regex = 1;
+        m->is_literal = 1;
+        m->literal = words[0];
+        m->literal_len = strlen(words[0]);
+        nwords = 0;
+    } else if (nwords > 0) {
+        m->ac = ac_build(words, nwords);
+        if (m->ac == NULL) goto out;
+    }
+
+    int separate = 0;
+    for (int i = 0; i < nregexes; i++) {
+        if (grep_has_backref(regexes[i])) separate = 1;
+    }
+
+    if (nregexes == 1 || separate) {
+        m->regex = malloc(nregexes * sizeof(regex_t));
+        if (m->regex == NULL) goto out;
+        for (; m->nregex < nregexes; m->nregex++) {
+            if (regcomp(&m->regex[m->nregex], regexes[m->nregex], REG_EXTENDED | REG_NEWLINE)) goto out;
+        }
+        m->use_regex = 1;
+        if (nregexes == 1) {
+            m->literal = grep_literal_of(regexes[0], &m->literal_len, &m->is_literal);
+        }
+    } else if (nregexes > 1) {
+        size_t total = 1;
+        for (int i = 0; i < nregexes; i++) {
+            total += strlen(regexes[i]) + 3;
+        }
+        m->regex = malloc(sizeof(regex_t));
+        if (m->regex == NULL) goto out;
+        char *joined = malloc(total);
+        if (joined == NULL) goto out;
+        char *q = joined;
+        for (int i = 0; i < nregexes; i++) {
+            q += sprintf(q, "%s(%s)", i ? "|" : "", regexes[i]);
+        }
+        int failed = regcomp(m->regex, joined, REG_EXTENDED | REG_NEWLINE);
+        free(joined);
+        if (failed) goto out;
+        m->nregex = 1;
+        m->use_regex = 1;
+    }
+
+    for (size_t i = 0; i < m->literal_len; i++) {
+        if (grep_byte_rarity((unsigned char)m->literal[i])
+            >= grep_byte_rarity((unsigned char)m->literal[m->rare_index])) {
+            m->rare_index = i;
+        }
+    }
+    rc = 0;
+
+out:
+    if (rc != 0) {
+        grep_matcher_free(m);
+        m->ac = NULL;
+        m->literal = NULL;
+        m->regex = NULL;
+        m->nregex = 0;
+    }
+    for (int i = 0; i < nwords; i++) {
+        free(words[i]);
+    }
+    free(words);
+    free(regexes);
+    return rc;
+}
+
+static const char *grep_find_literal(const struct grep_matcher *m, const char *buf, size_t len) {
+    size_t n = m->literal_len;
+    if (n == 0) return buf;
+    if (n > len) return NULL;
+
+    /* memchr (vectorised in glibc) for the rarest needle byte, then verify */
+    size_t k = m->rare_index;
+    char rare = m->literal[k];
+    const char *p = buf + k;
+    const char *last = buf + (len - n) + k;
+    while (p <= last) {
+        p = memchr(p, rare, (size_t)(last - p) + 1);
+        if (p == NULL) return NULL;
+        if (memcmp(p - k, m->literal, n) == 0) return p - k;
+        p++;
+    }
+    return NULL;
+}
+
+struct grep_opts {
+    int mode;
+    long max_count;
+    int multiple_files;
+};
+
+/*
+ * Per-search state: where matches go and how many have been selected.
+ * The scan stops as soon as count reaches limit.
+ */
+struct grep_sink {
+    const char *name;
+    size_t name_len;
+    int mode;
+    long limit;
+    long count;
+    struct output *out;
+};
+
+static void grep_sink_init(struct grep_sink *sink, const struct grep_opts *opts,
+                           const char *name, struct output *out) {
+    sink->name = name;
+    sink->name_len = name ? strlen(name) : 0;
+    sink->mode = opts->mode;
+    sink->limit = opts->max_count;
+    if ((opts->mode == GREP_MODE_FILES || opts->mode == GREP_MODE_QUIET) && sink->limit != 0) {
+        sink->limit = 1;
+    }
+    sink->count = 0;
+    sink->out = out;
+}
+
+static int grep_sink_full(const struct grep_sink *sink) {
+    return sink->limit >= 0 && sink->count >= sink->limit;
+}
+
+static int grep_emit(struct grep_sink *sink, const char *line, size_t len) {
+    sink->count++;
+    if (sink->mode != GREP_MODE_LINES) return 0;
+    if (sink->name != NULL) {
+        if (output_put(sink->out, sink->name, sink->name_len) == -1
+            || output_put(sink->out, ":", 1) == -1) {
+            return -1;
+        }
+    }
+    return output_put_ref(sink->out, line, len);
+}
+
+/* Writes the per-file result of -c and -l once the scan is over */
+static int grep_sink_finish(struct grep_sink *sink, const char *file_name) {
+    char buf[32];
+    if (sink->mode == GREP_MODE_COUNT) {
+        int n = snprintf(buf, sizeof(buf), "%ld\n", sink->count);
+        if (sink->name != NULL) {
+            if (output_put(sink->out, sink->name, sink->name_len) == -1
+                || output_put(sink->out, ":", 1) == -1) {
+                return -1;
             }
+        }
+        return output_put(sink->out, buf, (size_t)n);
+    }
+    if (sink->mode == GREP_MODE_FILES && sink->count > 0) {
+        if (output_put(sink->out, file_name, strlen(file_name)) == -1) return -1;
+        return output_put(sink->out, "\n", 1);
+    }
+    return 0;
+}
+
+/* regexec over every compiled regex; *pm gets the earliest match */
+static int grep_regexec(const struct grep_matcher *m, const char *p, regmatch_t *pm) {
+    regmatch_t best = { -1, -1 };
+    for (int i = 0; i < m->nregex; i++) {
+        regmatch_t cur = *pm;
+        if (regexec(&m->regex[i], p, 1, &cur, REG_STARTEND) == 0
+            && (best.rm_so == -1 || cur.rm_so < best.rm_so)) {
+            best = cur;
+        }
+    }
+    if (best.rm_so == -1) return REG_NOMATCH;
+    *pm = best;
+    return 0;
+}
+
+/*
+ * First position at or after p (a line start) that lies on a line selected
+ * by the regex side of the matcher, or NULL. With a literal the buffer is
+ * searched for it and regexec only confirms the candidate line; otherwise
+ * regexec runs over windows of many lines at once.
+ */
+static const char *grep_next_regex(const struct grep_matcher *m, const char *p, const char *end) {
+    while (p < end) {
+        if (m->literal != NULL) {
+            const char *hit = grep_find_literal(m, p, (size_t)(end - p));
+            if (hit == NULL || m->is_literal) return hit;
+
+            const char *line = memrchr(p, '\n', (size_t)(hit - p));
+            line = line ? line + 1 : p;
+            const char *eol = memchr(hit, '\n', (size_t)(end - hit));
+            regmatch_t pm = { 0, (eol ? eol : end) - line };
+            if (grep_regexec(m, line, &pm) == 0) return hit;
+            p = eol ? eol + 1 : end;
+            continue;
+        }
+
+        const char *wend = end;
+        if ((size_t)(end - p) > GREP_REGEX_WINDOW) {
+            wend = memrchr(p, '\n', GREP_REGEX_WINDOW);
+            if (wend == NULL) {
+                wend = memchr(p + GREP_REGEX_WINDOW, '\n', (size_t)(end - p) - GREP_REGEX_WINDOW);
+                if (wend == NULL) wend = end;
+            }
+        }
+        if (wend == end && end[-1] == '\n') wend--;
+
+        regmatch_t pm = { 0, wend - p };
+        if (grep_regexec(m, p, &pm) == 0) return p + pm.rm_so;
+        p = wend + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Scans a buffer of whole lines (only the last one may lack '\n') and emits
+ * the matching ones in order. The buffer is searched as a whole, line
+ * boundaries are looked up only around hits. The automaton and the regex
+ * side each remember their next hit, so neither rescans text.
+ */
+static int grep_scan(const struct grep_matcher *m, const char *buf, size_t len, struct grep_sink *sink) {
+    const char *p = buf;
+    const char *end = buf + len;
+    const char *ac_hit = NULL, *re_hit = NULL;
+    int ac_done = (m->ac == NULL), re_done = !m->use_regex;
+
+    while (p < end && !grep_sink_full(sink)) {
+        const char *hit = NULL;
+
+        if (m->match_all) {
+            hit = p;
         } else {
-            printf("%s", line);
+            if (!ac_done && (ac_hit == NULL || ac_hit < p)) {
+                ac_hit = ac_find(m->ac, p, end);
+                if (ac_hit == NULL) ac_done = 1;
+            }
+            if (!re_done && (re_hit == NULL || re_hit < p)) {
+                re_hit = grep_next_regex(m, p, end);
+                if (re_hit == NULL) re_done = 1;
+            }
+            if (!ac_done) hit = ac_hit;
+            if (!re_done && (hit == NULL || re_hit < hit)) hit = re_hit;
+            if (hit == NULL) break;
+        }
+
+        const char *line = memrchr(p, '\n', (size_t)(hit - p));
+        line = line ? line + 1 : p;
+        const char *eol = memchr(hit, '\n', (size_t)(end - hit));
+        const char *next = eol ? eol + 1 : end;
+
+        if (grep_emit(sink, line, (size_t)(next - line)) == -1) {
+            return errno;
+        }
+        p = next;
+    }
+    return 0;
+}
+
+/*
+ * Unit of work for the ordered pool: either a whole file or a
+ * newline-aligned slice of one mapped file.
+ */
+struct grep_task {
+    const char *file_name;
+    const char *start;
+    size_t len;
+    struct output out;
+    long count;
+    int err;
+    int done;
+};
+
+struct grep_pool {
+    const struct grep_matcher *matcher;
+    const struct grep_opts *opts;
+    const char *slice_name;
+    struct grep_task *tasks;
+    int ntasks;
+    int next;
+    int collected;
+    int window;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static void grep_pool_run_task(struct grep_pool *pool, struct grep_task *task) {
+    if (task->file_name != NULL) {
+        task->err = mygrep_search(pool->matcher, pool->opts, task->file_name, 1, &task->out, &task->count);
+    } else {
+        struct grep_sink sink;
+        grep_sink_init(&sink, pool->opts, pool->slice_name, &task->out);
+        task->err = grep_scan(pool->matcher, task->start, task->len, &sink);
+        task->count = sink.count;
+    }
+}
+
+static void *grep_pool_worker(void *arg) {
+    struct grep_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->next < pool->ntasks) {
+        /* do not run too far ahead of the collector: finished buffers wait in memory */
+        if (pool->next >= pool->collected + pool->window) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
+        struct grep_task *task = &pool->tasks[pool->next++];
+        pthread_mutex_unlock(&pool->mutex);
+
+        grep_pool_run_task(pool, task);
+
+        pthread_mutex_lock(&pool->mutex);
+        task->done = 1;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/*
+ * Runs all tasks on nthreads workers and hands each finished task to
+ * collect strictly in task order, from the calling thread.
+ */
+static void grep_pool_run(struct grep_pool *pool, int nthreads,
+                          void (*collect)(struct grep_task *, void *), void *arg) {
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    int started = 0;
+
+    pool->next = 0;
+    pool->collected = 0;
+    pool->window = nthreads * 4;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (; threads != NULL && started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, grep_pool_worker, pool) != 0) break;
+    }
+    if (started == 0) {
+        /* no threads at all: do the work here */
+        pool->window = pool->ntasks;
+        grep_pool_worker(pool);
+    }
+
+    for (int i = 0; i < pool->ntasks; i++) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->tasks[i].done) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        collect(&pool->tasks[i], arg);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->collected = i + 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(threads);
+}
+
+/* Overall outcome in grep terms: something selected, and/or some error */
+struct grep_result {
+    struct output *out;
+    int matched;
+    int error;
+};
+
+static void mygrep_report(struct grep_task *task, void *arg) {
+    struct grep_result *res = arg;
+    if (output_put(res->out, task->out.data, task->out.len) == -1) {
+        perror("write");
+        res->error = 1;
+    }
+    output_free(&task->out);
+    if (task->err) {
+        if (output_flush(res->out) == -1) res->error = 1;
+        fprintf(stderr, "%s: %s\n", task->file_name ? task->file_name : "(standard input)", strerror(task->err));
+        res->error = 1;
+    }
+    if (task->count > 0) {
+        res->matched = 1;
+    }
+}
+
+static void grep_collect_slice(struct grep_task *task, void *arg) {
+    struct grep_sink *sink = arg;
+    if (task->err == 0 && output_put(sink->out, task->out.data, task->out.len) == -1) {
+        task->err = errno;
+    }
+    sink->count += task->count;
+    output_free(&task->out);
+}
+
+/*
+ * Splits a mapped file into newline-aligned slices searched in parallel.
+ * Slices are collected in order, so output matches a sequential scan and a
+ * per-slice newline count is all a line-numbering mode would need.
+ */
+static int grep_scan_parallel(const struct grep_matcher *m, const struct grep_opts *opts,
+                              const char *buf, size_t len, struct grep_sink *sink, int nthreads) {
+    size_t slice = len / ((size_t)nthreads * 4);
+    if (slice < GREP_SPLIT_MIN) slice = GREP_SPLIT_MIN;
+    int nslices = (int)((len + slice - 1) / slice);
+
+    struct grep_pool pool = {
+        .matcher = m,
+        .opts = opts,
+        .slice_name = sink->name,
+        .tasks = calloc(nslices, sizeof(struct grep_task)),
+    };
+    if (pool.tasks == NULL) return errno;
+
+    const char *p = buf;
+    const char *end = buf + len;
+    while (p < end) {
+        const char *cut = end;
+        if ((size_t)(end - p) > slice) {
+            const char *nl = memchr(p + slice, '\n', (size_t)(end - p) - slice);
+            if (nl != NULL) cut = nl + 1;
+        }
+        struct grep_task *task = &pool.tasks[pool.ntasks++];
+        task->start = p;
+        task->len = (size_t)(cut - p);
+        output_init(&task->out, -1);
+        p = cut;
+    }
+
+    grep_pool_run(&pool, nthreads, grep_collect_slice, sink);
+
+    int err = 0;
+    for (int i = 0; i < pool.ntasks; i++) {
+        output_free(&pool.tasks[i].out);
+        if (err == 0) err = pool.tasks[i].err;
+    }
+    free(pool.tasks);
+    return err;
+}
+
+static void mygrep_run_files(const struct grep_matcher *m, const struct grep_opts *opts,
+                             char **files, int nfiles, int nthreads, struct grep_result *res) {
+    if (nfiles == 1 || nthreads == 1 || opts->mode == GREP_MODE_QUIET) {
+        /* one file at a time: a large file is split across the threads instead */
+        for (int i = 0; i < nfiles; i++) {
+            struct grep_task task = { .file_name = files[i] };
+            output_init(&task.out, -1);
+            task.err = mygrep_search(m, opts, files[i], nthreads, res->out, &task.count);
+            mygrep_report(&task, res);
+            if (res->matched && opts->mode == GREP_MODE_QUIET) return;
         }
+        return;
+    }
+
+    if (nthreads > nfiles) nthreads = nfiles;
+    struct grep_pool pool = {
+        .matcher = m,
+        .opts = opts,
+        .tasks = calloc(nfiles, sizeof(struct grep_task)),
+        .ntasks = nfiles,
+    };
+    if (pool.tasks == NULL) {
+        perror("malloc");
+        res->error = 1;
+        return;
     }
+    for (int i = 0; i < nfiles; i++) {
+        pool.tasks[i].file_name = files[i];
+        output_init(&pool.tasks[i].out, -1);
+    }
+
+    grep_pool_run(&pool, nthreads, mygrep_report, res);
+    free(pool.tasks);
+}
 
-    free(line);
+static void mygrep_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-c|-l|-q] [-m N] [-j N] pattern [file...]\n", prog);
+    fprintf(stderr, "       %s [-c|-l|-q] [-m N] [-j N] {-e pattern|-f file}... [file...]\n", prog);
 }
 
+struct grep_patterns {
+    char **items;
+    int count;
+    int cap;
+};
+
+/* Adds every line of text as a pattern; a final newline does not add an empty one */
+static int grep_patterns_add(struct grep_patterns *list, const char *text, size_t len, int from_file) {
+    const char *p = text;
+    const char *end = text + len;
+    for (;;) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        const char *stop = nl ? nl : end;
+        if (nl == NULL && from_file && p == end) break;
+
+        if (list->count == list->cap) {
+            int new_cap = list->cap ? list->cap * 2 : 16;
+            char **items = realloc(list->items, new_cap * sizeof(char *));
+            if (items == NULL) return -1;
+            list->items = items;
+            list->cap = new_cap;
+        }
+        list->items[list->count] = strndup(p, (size_t)(stop - p));
+        if (list->items[list->count] == NULL) return -1;
+        list->count++;
+
+        if (nl == NULL) break;
+        p = nl + 1;
+    }
+    return 0;
+}
+
+static int grep_patterns_load(struct grep_patterns *list, const char *file_name) {
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) return -1;
+
+    size_t cap = 4096, len = 0;
+    char *text = malloc(cap);
+    ssize_t n = 0;
+    while (text != NULL) {
+        if (len == cap) {
+            char *grown = realloc(text, cap * 2);
+            if (grown == NULL) break;
+            text = grown;
+            cap *= 2;
+        }
+        n = read(fd, text + len, cap - len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += (size_t)n;
+    }
+    close(fd);
+
+    int rc = -1;
+    if (text != NULL && n == 0) {
+        rc = grep_patterns_add(list, text, len, 1);
+    }
+    free(text);
+    return rc;
+}
+
+static void grep_patterns_free(struct grep_patterns *list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+}
 
 int mygrep_main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s pattern [file...]\n", argv[0]);
+    int opt;
+    int nthreads = 0;
+    struct grep_opts opts = { GREP_MODE_LINES, -1, 0 };
+    struct grep_patterns patterns = { NULL, 0, 0 };
+    int have_patterns = 0;
+
+    struct option long_options[] = {
+        {"regexp", required_argument, 0, 'e'},
+        {"file", required_argument, 0, 'f'},
+        {"count", no_argument, 0, 'c'},
+        {"files-with-matches", no_argument, 0, 'l'},
+        {"quiet", no_argument, 0, 'q'},
+        {"silent", no_argument, 0, 'q'},
+        {"max-count", required_argument, 0, 'm'},
+        {"jobs", required_argument, 0, 'j'},
+        {0, 0, 0, 0}
+    };
+
+    optind = 1; // Reset getopt
+    while ((opt = getopt_long(argc, argv, "+e:f:clqm:j:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'e':
+                have_patterns = 1;
+                if (grep_patterns_add(&patterns, optarg, strlen(optarg), 0) == -1) {
+                    perror("malloc");
+                    grep_patterns_free(&patterns);
+                    return 2;
+                }
+                break;
+            case 'f':
+                have_patterns = 1;
+                if (grep_patterns_load(&patterns, optarg) == -1) {
+                    perror(optarg);
+                    grep_patterns_free(&patterns);
+                    return 2;
+                }
+                break;
+            case 'c':
+                if (opts.mode != GREP_MODE_FILES && opts.mode != GREP_MODE_QUIET) opts.mode = GREP_MODE_COUNT;
+                break;
+            case 'l':
+                if (opts.mode != GREP_MODE_QUIET) opts.mode = GREP_MODE_FILES;
+                break;
+            case 'q':
+                opts.mode = GREP_MODE_QUIET;
+                break;
+            case 'm': {
+                char *endptr;
+                opts.max_count = strtol(optarg, &endptr, 10);
+                if (*optarg == '\0' || *endptr != '\0') {
+                    fprintf(stderr, "Invalid max count: %s\n", optarg);
+                    grep_patterns_free(&patterns);
+                    return 2;
+                }
+                /* negative means no limit, as in GNU grep */
+                if (opts.max_count < 0) opts.max_count = -1;
+                break;
+            }
+            case 'j':
+                nthreads = atoi(optarg);
+                if (nthreads <= 0) {
+                    fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                    grep_patterns_free(&patterns);
+                    return 2;
+                }
+                break;
+            default:
+                mygrep_usage(argv[0]);
+                grep_patterns_free(&patterns);
+                return 2;
+        }
+    }
+
+    if (!have_patterns) {
+        if (optind >= argc) {
+            mygrep_usage(argv[0]);
+            return 2;
+        }
+        const char *pattern = argv[optind++];
+        if (grep_patterns_add(&patterns, pattern, strlen(pattern), 0) == -1) {
+            perror("malloc");
+            grep_patterns_free(&patterns);
+            return 2;
+        }
+    }
+
+    struct grep_matcher matcher;
+    int failed = grep_matcher_compile(&matcher, patterns.items, patterns.count);
+    grep_patterns_free(&patterns);
+    if (failed) {
+        fprintf(stderr, "Could not compile regex\n");
+        return 2;
+    }
+
+    if (opts.max_count == 0) {
+        /* nothing can be selected, no need to open anything */
+        grep_matcher_free(&matcher);
         return 1;
     }
 
-    const char *pattern = argv[1];
-    int exit_status = 0;
-    int multiple_files = (argc > 3);
+    if (nthreads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? (int)ncpu : 1;
+    }
 
-    if (argc == 2) {
-        mygrep_search_in_stdin(pattern);
+    struct output out;
+    output_init(&out, STDOUT_FILENO);
+    struct grep_result res = { &out, 0, 0 };
+
+    char *stdin_only[] = { NULL };
+    char **files = (optind == argc) ? stdin_only : &argv[optind];
+    int nfiles = (optind == argc) ? 1 : argc - optind;
+    opts.multiple_files = (nfiles > 1);
+    mygrep_run_files(&matcher, &opts, files, nfiles, nthreads, &res);
+
+    if (output_flush(&out) == -1) {
+        perror("write");
+        res.error = 1;
+    }
+    output_free(&out);
+    grep_matcher_free(&matcher);
+
+    /* grep convention: 0 selected, 1 nothing selected, 2 error (-q with a match wins) */
+    if (res.matched && (opts.mode == GREP_MODE_QUIET || !res.error)) return 0;
+    return res.error ? 2 : 1;
+}
+
+/*
+ * Searches one file (NULL for stdin). Returns 0 or the errno of the
+ * failure; output goes to out, the selected line count to count.
+ */
+int mygrep_search(const struct grep_matcher *m, const struct grep_opts *opts, const char *file_name,
+                  int nthreads, struct output *out, long *count) {
+    struct input in;
+    struct grep_sink sink;
+    const char *data;
+    size_t len;
+    int err = 0;
+
+    *count = 0;
+    if (input_open(&in, file_name) == -1) {
+        return errno;
+    }
+    grep_sink_init(&sink, opts, opts->multiple_files ? in.name : NULL, out);
+
+    if (grep_sink_full(&sink)) {
+        /* nothing more to select */
+    } else if (input_map(&in, &data, &len) == 0) {
+        /* early-exit modes stop at the first hits, splitting would only read ahead */
+        if (nthreads > 1 && len >= 2 * GREP_SPLIT_MIN && sink.limit < 0) {
+            err = grep_scan_parallel(m, opts, data, len, &sink, nthreads);
+        } else {
+            err = grep_scan(m, data, len, &sink);
+        }
     } else {
-        for (int i = 2; i < argc; i++) {
-            exit_status |= mygrep_search_in_file(pattern, argv[i], multiple_files);
+        ssize_t n;
+        while (!grep_sink_full(&sink) && (n = input_read_lines(&in, &data)) != 0) {
+            if (n == -1) {
+                err = errno;
+                break;
+            }
+            err = grep_scan(m, data, (size_t)n, &sink);
+            /* matched lines may point into the chunk */
+            if (err == 0 && output_flush(out) == -1) err = errno;
+            if (err) break;
         }
     }
 
-    return exit_status;
+    if (err == 0 && output_flush(out) == -1) {
+        err = errno;
+    }
+    input_close(&in);
+
+    *count = sink.count;
+    if (err == 0 && grep_sink_finish(&sink, in.name) == -1) {
+        err = errno;
+    }
+    return err;
 }
 
-int mygrep_search_in_file(const char *pattern, const char *file_name, int multiple_files) {
-    FILE *file = fopen(file_name, "r");
-    if (file == NULL) {
-        perror(file_name);
-        return 1;
+struct wc_counts {
+    long long lines;
+    long long words;
+    long long bytes;
+};
+
+/* isspace() of the C locale, as a table */
+static unsigned char wc_space[256];
+
+static void wc_count_buf(struct wc_counts *c, const char *buf, size_t len, int want, int *in_word) {
+    c->bytes += (long long)len;
+    if (!(want & WC_WORDS)) {
+        const char *p = buf;
+        const char *end = buf + len;
+        while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+            c->lines++;
+            p++;
+        }
+        return;
+    }
+
+    int w = *in_word;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = (unsigned char)buf[i];
+        if (wc_space[ch]) {
+            if (ch == '\n') c->lines++;
+            w = 0;
+        } else if (!w) {
+            c->words++;
+            w = 1;
+        }
     }
+    *in_word = w;
+}
 
-    char *line = NULL;
-    size_t len = 0;
-    regex_t regex;
+static int wc_count(struct input *in, int want, struct wc_counts *c) {
+    const char *data;
+    size_t len;
+    int in_word = 0;
 
-    if (regcomp(&regex, pattern, REG_EXTENDED)) {
-        fprintf(stderr, "Could not compile regex\n");
-        fclose(file);
+    memset(c, 0, sizeof(*c));
+    if (want == WC_BYTES && S_ISREG(in->st.st_mode) && in->st.st_size > 0) {
+        c->bytes = (long long)in->st.st_size;
+        return 0;
+    }
+    if (input_map(in, &data, &len) == 0) {
+        wc_count_buf(c, data, len, want, &in_word);
+        return 0;
+    }
+
+    ssize_t n;
+    while ((n = input_read(in, &data)) > 0) {
+        wc_count_buf(c, data, (size_t)n, want, &in_word);
+    }
+    return n == 0 ? 0 : -1;
+}
+
+static int wc_print(struct output *out, const struct wc_counts *c, int want, int width, const char *name) {
+    char line[128];
+    int len = 0;
+    const long long values[] = { c->lines, c->words, c->bytes };
+    const int bits[] = { WC_LINES, WC_WORDS, WC_BYTES };
+
+    for (int i = 0; i < 3; i++) {
+        if (want & bits[i]) {
+            len += snprintf(line + len, sizeof(line) - len, "%s%*lld", len ? " " : "", width, values[i]);
+        }
+    }
+    if (output_put(out, line, (size_t)len) == -1) return -1;
+    if (name != NULL) {
+        if (output_put(out, " ", 1) == -1 || output_put(out, name, strlen(name)) == -1) return -1;
+    }
+    return output_put(out, "\n", 1);
+}
+
+int mywc_main(int argc, char *argv[]) {
+    int opt;
+    int want = 0;
+    int exit_status = 0;
+
+    struct option long_options[] = {
+        {"lines", no_argument, 0, 'l'},
+        {"words", no_argument, 0, 'w'},
+        {"bytes", no_argument, 0, 'c'},
+        {0, 0, 0, 0}
+    };
+
+    optind = 1; // Reset getopt
+    while ((opt = getopt_long(argc, argv, "lwc", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+                want |= WC_LINES;
+                break;
+            case 'w':
+                want |= WC_WORDS;
+                break;
+            case 'c':
+                want |= WC_BYTES;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-l] [-w] [-c] [file...]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (want == 0) want = WC_LINES | WC_WORDS | WC_BYTES;
+
+    for (const char *s = " \t\n\v\f\r"; *s; s++) {
+        wc_space[(unsigned char)*s] = 1;
+    }
+
+    char *stdin_only[] = { NULL };
+    char **files = (optind == argc) ? stdin_only : &argv[optind];
+    int nfiles = (optind == argc) ? 1 : argc - optind;
+
+    struct wc_counts *counts = calloc(nfiles, sizeof(struct wc_counts));
+    char *ok = calloc(nfiles, 1);
+    if (counts == NULL || ok == NULL) {
+        perror("malloc");
+        free(counts);
+        free(ok);
         return 1;
     }
 
-    while (getline(&line, &len, file) != -1) {
-        if (regexec(&regex, line, 0, NULL, 0) == 0) {
-            if (multiple_files) {
-                printf("%s:%s", file_name, line);
-            } else {
-                printf("%s", line);
+    /* Count everything first so the columns can be sized, like GNU wc:
+     * from the summed sizes of regular files, at least 7 for anything else */
+    struct wc_counts total = { 0, 0, 0 };
+    long long widest = 0;
+    int odd_input = 0;
+    for (int i = 0; i < nfiles; i++) {
+        struct input in;
+        const char *name = files[i] ? files[i] : "stdin";
+        if (input_open(&in, files[i]) == -1) {
+            perror(name);
+            exit_status = 1;
+            continue;
+        }
+        if (S_ISREG(in.st.st_mode)) {
+            widest += (long long)in.st.st_size;
+        } else {
+            odd_input = 1;
+        }
+        if (wc_count(&in, want, &counts[i]) == -1) {
+            perror(name);
+            exit_status = 1;
+        } else {
+            ok[i] = 1;
+            total.lines += counts[i].lines;
+            total.words += counts[i].words;
+            total.bytes += counts[i].bytes;
+        }
+        input_close(&in);
+    }
+
+    int width = 1;
+    while (widest >= 10) {
+        widest /= 10;
+        width++;
+    }
+    if (odd_input && width < 7) width = 7;
+    if (nfiles == 1 && (want == WC_LINES || want == WC_WORDS || want == WC_BYTES)) width = 1;
+
+    struct output out;
+    output_init(&out, STDOUT_FILENO);
+    for (int i = 0; i < nfiles; i++) {
+        if (ok[i]) wc_print(&out, &counts[i], want, width, files[i]);
+    }
+    if (nfiles > 1) {
+        wc_print(&out, &total, want, width, "total");
+    }
+    if (output_flush(&out) == -1) {
+        perror("write");
+        exit_status = 1;
+    }
+
+    output_free(&out);
+    free(counts);
+    free(ok);
+    return exit_status;
+}
+
+/* Parses the count of -n/-c for myhead and mytail */
+static int parse_count(const char *arg, long long *value) {
+    char *endptr;
+    errno = 0;
+    *value = strtoll(arg, &endptr, 10);
+    if (*arg == '\0' || *endptr != '\0' || errno != 0 || *value < 0) {
+        fprintf(stderr, "Invalid number: %s\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+static int put_file_header(struct output *out, const char *name, int first) {
+    if (!first && output_put(out, "\n", 1) == -1) return -1;
+    if (output_put(out, "==> ", 4) == -1 || output_put(out, name, strlen(name)) == -1) return -1;
+    return output_put(out, " <==\n", 5);
+}
+
+/* Copies the first count lines (or bytes) and stops reading right after them */
+static int head_process(struct input *in, long long count, int bytes, struct output *out) {
+    const char *data;
+    ssize_t n = 0;
+
+    while (count > 0 && (n = input_read(in, &data)) > 0) {
+        size_t take = (size_t)n;
+        if (bytes) {
+            if ((long long)take > count) take = (size_t)count;
+            count -= (long long)take;
+        } else {
+            const char *p = data;
+            const char *end = data + n;
+            while (count > 0 && (p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+                p++;
+                count--;
             }
+            if (count == 0) take = (size_t)(p - data);
         }
+        if (output_put_ref(out, data, take) == -1 || output_flush(out) == -1) return -1;
     }
+    return n == -1 ? -1 : 0;
+}
 
-    regfree(&regex);
-    free(line);
-    fclose(file);
+/*
+ * Start of the last count lines of buf. A final newline ends the last line
+ * rather than starting an empty one.
+ */
+static size_t tail_lines_start(const char *buf, size_t len, long long count) {
+    size_t pos = len;
+    if (count == 0) return len;
+    if (pos > 0 && buf[pos - 1] == '\n') pos--;
+    while (pos > 0) {
+        const char *nl = memrchr(buf, '\n', pos);
+        if (nl == NULL) return 0;
+        if (--count == 0) return (size_t)(nl - buf) + 1;
+        pos = (size_t)(nl - buf);
+    }
     return 0;
 }
 
-void mygrep_search_in_stdin(const char *pattern) {
-    char *line = NULL;
-    size_t len = 0;
-    regex_t regex;
+/*
+ * Regular files are mapped and searched backwards from the end. Other
+ * input is read through, keeping a window that is cut down to the last
+ * count lines whenever it has grown enough to make that worthwhile.
+ */
+static int tail_process(struct input *in, long long count, int bytes, struct output *out) {
+    const char *data;
+    size_t len;
 
-    if (regcomp(&regex, pattern, REG_EXTENDED)) {
-        fprintf(stderr, "Could not compile regex\n");
-        return;
+    if (input_map(in, &data, &len) == 0) {
+        size_t start = bytes ? (len > (size_t)count ? len - (size_t)count : 0)
+                             : tail_lines_start(data, len, count);
+        if (output_put_ref(out, data + start, len - start) == -1 || output_flush(out) == -1) return -1;
+        return 0;
     }
 
-    while (getline(&line, &len, stdin) != -1) {
-        if (regexec(&regex, line, 0, NULL, 0) == 0) {
-            printf("%s", line);
+    char *win = NULL;
+    size_t win_len = 0, win_cap = 0;
+    ssize_t n;
+    int rc = 0;
+
+    while ((n = input_read(in, &data)) > 0) {
+        if (win_len + (size_t)n > win_cap) {
+            size_t start = bytes ? (win_len > (size_t)count ? win_len - (size_t)count : 0)
+                                 : tail_lines_start(win, win_len, count);
+            if (start > win_len / 2) {
+                memmove(win, win + start, win_len - start);
+                win_len -= start;
+            }
+        }
+        if (win_len + (size_t)n > win_cap) {
+            size_t new_cap = win_cap ? win_cap : INPUT_BUF_SIZE;
+            while (new_cap < win_len + (size_t)n) new_cap *= 2;
+            char *grown = realloc(win, new_cap);
+            if (grown == NULL) {
+                rc = -1;
+                break;
+            }
+            win = grown;
+            win_cap = new_cap;
         }
+        memcpy(win + win_len, data, (size_t)n);
+        win_len += (size_t)n;
     }
+    if (n == -1) rc = -1;
+
+    if (rc == 0) {
+        size_t start = bytes ? (win_len > (size_t)count ? win_len - (size_t)count : 0)
+                             : tail_lines_start(win, win_len, count);
+        if (output_put_ref(out, win + start, win_len - start) == -1 || output_flush(out) == -1) rc = -1;
+    }
+    free(win);
+    return rc;
+}
+
+static int head_tail_main(int argc, char *argv[],
+                          int (*process)(struct input *, long long, int, struct output *)) {
+    int opt;
+    long long count = 10;
+    int bytes = 0;
+    int exit_status = 0;
+
+    struct option long_options[] = {
+        {"lines", required_argument, 0, 'n'},
+        {"bytes", required_argument, 0, 'c'},
+        {0, 0, 0, 0}
+    };
+
+    optind = 1; // Reset getopt
+    while ((opt = getopt_long(argc, argv, "n:c:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+            case 'c':
+                if (parse_count(optarg, &count) == -1) return 1;
+                bytes = (opt == 'c');
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n lines | -c bytes] [file...]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    /* Like GNU tail, an empty tail does not even open the files */
+    if (process == tail_process && count == 0) return 0;
+
+    struct output out;
+    output_init(&out, STDOUT_FILENO);
+
+    char *stdin_only[] = { NULL };
+    char **files = (optind == argc) ? stdin_only : &argv[optind];
+    int nfiles = (optind == argc) ? 1 : argc - optind;
+    int shown_header = 0;
+
+    for (int i = 0; i < nfiles; i++) {
+        struct input in;
+        const char *name = files[i] ? files[i] : "stdin";
+        if (input_open(&in, files[i]) == -1) {
+            perror(name);
+            exit_status = 1;
+            continue;
+        }
+        if (nfiles > 1 && put_file_header(&out, in.name, !shown_header) == -1) {
+            perror("write");
+            exit_status = 1;
+        }
+        shown_header = 1;
+        if (process(&in, count, bytes, &out) == -1) {
+            perror(name);
+            exit_status = 1;
+        }
+        input_close(&in);
+    }
+
+    if (output_flush(&out) == -1) {
+        perror("write");
+        exit_status = 1;
+    }
+    output_free(&out);
+    return exit_status;
+}
+
+int myhead_main(int argc, char *argv[]) {
+    return head_tail_main(argc, argv, head_process);
+}
 
-    regfree(&regex);
-    free(line);
+int mytail_main(int argc, char *argv[]) {
+    return head_tail_main(argc, argv, tail_process);
 }
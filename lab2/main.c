@@ -1,4 +1,5 @@
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +11,15 @@
 #include <grp.h>
 #include <time.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <locale.h>
+#include <stdint.h>
+#include <sys/sysmacros.h>
+#include <sys/inotify.h>
+#include <poll.h>
 
 
 #define COLOR_RESET   "\x1b[0m"
@@ -17,62 +27,513 @@
 #define COLOR_GREEN   "\x1b[32m" 
 #define COLOR_CYAN    "\x1b[36m" 
 
+/* Меньше записей параллельно статить не имеет смысла: потоки дороже */
+#define STAT_PARALLEL_MIN 2048
+#define STAT_CHUNK        256
+#define STAT_THREADS_MAX  16
 
+#define NAME_BLOCK_SIZE   (64 * 1024)
+#define DIRENT_BUF_SIZE   (256 * 1024)
+
+#define SORT_NAME         0
+#define SORT_TIME         1
+#define SORT_SIZE         2
+#define SORT_NONE         3
+
+/* Короче этого куски сортируются вставками */
+#define SORT_INSERTION_MAX 12
+
+#define OUTBUF_SIZE       (256 * 1024)
+
+/* Полгода в секундах: старше — вместо времени печатается год, как у ls */
+#define SIX_MONTHS        (31556952 / 2)
+
+#define SNAPSHOT_MAGIC    "MYLSSNP1"
+
+/* Каталог, изменённый недавно, мог измениться ещё раз в тот же тик часов */
+#define SNAPSHOT_RACY_SEC 2
+
+/* Сколько ждать новых событий inotify, прежде чем обновить снимок */
+#define WATCH_DEBOUNCE_MS 200
+
+#define OPT_CACHE         256
+#define OPT_WATCH         257
+
+/* Сколько открытых дескрипторов каталогов может держать обход -R */
+#define WALK_FDS_MAX      1024
+/* Сколько готовых, но ещё не напечатанных листингов держит обход -R */
+#define WALK_AHEAD_MAX    1024
+
+/* Поля statx, которые реально печатаются в каждом из форматов */
+#define STATX_SHORT_MASK  (STATX_TYPE | STATX_MODE)
+#define STATX_LONG_MASK   (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | \
+                           STATX_GID | STATX_SIZE | STATX_BLOCKS | STATX_MTIME)
+
+
+/* Только те поля stat, что нужны для вывода: запись в ~6 раз меньше struct stat */
 typedef struct {
-    char name[256]; 
-    struct stat st; 
+    const char *name;
+    ino_t ino;
+    mode_t mode;
+    nlink_t nlink;
+    uid_t uid;
+    gid_t gid;
+    off_t size;
+    blkcnt_t blocks;
+    time_t mtime;
+    long mtime_nsec;
+    unsigned int rdev_major;
+    unsigned int rdev_minor;
+    int stat_errno;
+    int need_stat;
 } FileEntry;
 
+/* Имена лежат подряд в блоках арены и не переезжают при росте таблицы */
+typedef struct NameBlock {
+    struct NameBlock *next;
+    size_t used;
+    size_t cap;
+    char data[];
+} NameBlock;
+
+typedef struct {
+    NameBlock *head;
+} NameArena;
+
+typedef struct {
+    FileEntry *items;
+    int count;
+    int cap;
+} EntryTable;
+
+/* Кэш uid/gid -> имя: getpwuid/getgrgid могут уходить в NSS на каждый вызов */
+typedef struct {
+    unsigned int id;
+    char *name;
+} NameSlot;
+
+typedef struct {
+    NameSlot *slots;
+    size_t cap;
+    size_t used;
+} NameCache;
+
+typedef struct {
+    int show_all;
+    int long_format;
+    int recursive;
+    int sort;
+    int reverse;
+    int cache;
+} ListOptions;
+
+/*
+ * Снимок каталога на диске: заголовок с ключом (устройство, inode, mtime и
+ * ctime каталога), затем записи фиксированного размера и блок имён.
+ */
+typedef struct {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t ctime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint32_t count;
+    uint32_t names_size;
+} SnapshotHeader;
 
-void process_path(const char *path, int show_all, int long_format);
-void print_long_format(const char *path, const FileEntry *entry);
-void print_short_format(const FileEntry *entry);
-void print_file_type(mode_t mode);
-void print_permissions(mode_t mode);
-int compare_entries(const void *a, const void *b);
+typedef struct {
+    uint64_t ino;
+    uint64_t size;
+    uint64_t blocks;
+    int64_t mtime;
+    uint32_t mtime_nsec;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t rdev_major;
+    uint32_t rdev_minor;
+    uint32_t name_off;
+} SnapshotRecord;
+
+/*
+ * Ключ сортировки считается один раз на запись: strxfrm текущей локали
+ * (или само имя в локали C) и, для -t/-S, число, упорядоченное как беззнаковое.
+ */
+typedef struct {
+    const unsigned char *key;
+    uint64_t word;
+    uint64_t num;
+    int index;
+} SortItem;
+
+typedef struct {
+    char **names;
+    int count;
+    int cap;
+} NameList;
+
+/* Буфер вывода; при fd == -1 только копит в памяти (листинги для -R) */
+typedef struct {
+    int fd;
+    char *data;
+    size_t len;
+    size_t cap;
+} OutBuf;
+
+/*
+ * Ширины колонок -l, посчитанные заранее по всем строкам каталога, и
+ * последние отформатированные значения: соседние строки обычно делят
+ * владельца и минуту изменения.
+ */
+typedef struct {
+    int nlink_width;
+    int owner_width;
+    int group_width;
+    int size_width;
+    int major_width;
+    int minor_width;
+    time_t now;
+    long cached_minute;
+    int cached_recent;
+    char cached_date[64];
+    size_t cached_date_len;
+} RowFormat;
+
+/*
+ * Каталог в обходе -R. Листинг собирается в памяти рабочим потоком,
+ * а печатает его главный поток строго в порядке обхода в глубину.
+ * Флаги claimed/queued/printed меняются под walker->lock.
+ */
+typedef struct WalkNode {
+    char *path;
+    int fd;
+    int follow;             /* каталог из командной строки: ссылку разыменовать */
+    OutBuf out;
+    char *err;
+    size_t err_len;
+    struct WalkNode **children;
+    int nchildren;
+    int done;
+    int claimed;            /* кто-то уже читает этот каталог */
+    int queued;             /* указатель ещё лежит в одной из очередей */
+    int printed;
+} WalkNode;
+
+/* Владелец кладёт и берёт снизу, остальные потоки воруют сверху */
+typedef struct {
+    WalkNode **items;
+    int top;
+    int bottom;
+    int cap;
+    pthread_mutex_t lock;
+} WalkDeque;
+
+typedef struct {
+    const ListOptions *opts;
+    WalkDeque *deques;
+    int nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    int queued;
+    int pending;
+    int buffered;           /* листингов готово, но не напечатано */
+    int fds_open;
+    int fds_max;
+    char *print_buf;        /* dirent-буфер главного потока */
+} Walker;
+
+typedef struct {
+    Walker *walker;
+    int id;
+} WalkWorker;
+
+typedef struct {
+    int dir_fd;
+    unsigned int mask;
+    FileEntry *entries;
+    int count;
+    int next;
+} StatJob;
+
+
+void process_path(const char *path, const ListOptions *opts);
+void list_directory(int dir_fd, const char *path, const ListOptions *opts, char *dirent_buf,
+                    int stat_threads, OutBuf *out, FILE *err, NameList *subdirs);
+void walk_tree(const char *path, const ListOptions *opts);
+void print_long_format(OutBuf *out, RowFormat *fmt, int dir_fd, const FileEntry *entry);
+void print_short_format(OutBuf *out, const FileEntry *entry);
+void prepare_row_format(RowFormat *fmt, const FileEntry *entries, int count);
+void init_mode_table(void);
+void outbuf_init(OutBuf *out, int fd);
+void outbuf_put(OutBuf *out, const char *data, size_t len);
+void outbuf_flush(OutBuf *out);
+void outbuf_free(OutBuf *out);
+void sort_entries(FileEntry *entries, int count, const ListOptions *opts, NameArena *arena);
+int read_directory(int dir_fd, int show_all, int full_stat, int one_batch, char *buf,
+                   EntryTable *table, NameArena *names);
+void stat_entries(int dir_fd, unsigned int mask, FileEntry *entries, int count, int max_threads);
+void fill_entry(FileEntry *entry, const struct stat *st);
+void fill_entry_statx(FileEntry *entry, const struct statx *stx);
+char *arena_alloc(NameArena *arena, size_t len);
+const char *arena_strdup(NameArena *arena, const char *str, size_t len);
+void arena_free(NameArena *arena);
+FileEntry *table_push(EntryTable *table);
+int snapshot_refresh(int dir_fd, const char *path, char *dirent_buf, int stat_threads,
+                     const NameList *dirty, int restat_all, EntryTable *table, NameArena *names,
+                     FILE *err);
+int watch_directory(const char *path);
+const char *cached_name(NameCache *cache, unsigned int id, int is_group);
+
+static NameCache user_cache;
+static NameCache group_cache;
+static pthread_mutex_t name_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* "rwxr-xr-x" для каждого сочетания битов 07777, с s/S/t/T как у ls */
+static char mode_table[4096][9];
+static OutBuf stdout_buf;
 
 int main(int argc, char *argv[]) {
     int opt;
-    int show_all = 0;
-    int long_format = 0;
+    ListOptions opts = { 0, 0, 0, SORT_NAME, 0, 0 };
+    int watch = 0;
 
-    while ((opt = getopt(argc, argv, "la")) != -1) {
+    struct option long_options[] = {
+        {"cache", no_argument, 0, OPT_CACHE},
+        {"watch", no_argument, 0, OPT_WATCH},
+        {0, 0, 0, 0}
+    };
+
+    /* Порядок имён как у ls: по LC_COLLATE */
+    setlocale(LC_ALL, "");
+
+    while ((opt = getopt_long(argc, argv, "laRtSrUf", long_options, NULL)) != -1) {
         switch (opt) {
             case 'l':
-                long_format = 1;
+                opts.long_format = 1;
                 break;
             case 'a':
-                show_all = 1;
+                opts.show_all = 1;
+                break;
+            case 'R':
+                opts.recursive = 1;
+                break;
+            case 't':
+                opts.sort = SORT_TIME;
+                break;
+            case 'S':
+                opts.sort = SORT_SIZE;
+                break;
+            case 'r':
+                opts.reverse = 1;
+                break;
+            case 'f':
+                opts.show_all = 1;
+                /* fall through */
+            case 'U':
+                opts.sort = SORT_NONE;
+                break;
+            case OPT_CACHE:
+                opts.cache = 1;
+                break;
+            case OPT_WATCH:
+                watch = 1;
                 break;
             default: 
-                fprintf(stderr, "Использование: %s [-la] [файл...]\n", argv[0]);
+                fprintf(stderr, "Использование: %s [-laRtSrUf] [--cache] [файл...]\n", argv[0]);
+                fprintf(stderr, "              %s --watch каталог\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
+    if (watch) {
+        if (argc - optind != 1) {
+            fprintf(stderr, "Использование: %s --watch каталог\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        return watch_directory(argv[optind]);
+    }
+
+    /* Потоки обхода форматируют время через localtime_r */
+    tzset();
+    init_mode_table();
+    outbuf_init(&stdout_buf, STDOUT_FILENO);
+
     if (optind == argc) {
-        process_path(".", show_all, long_format);
+        process_path(".", &opts);
     } else {
         for (int i = optind; i < argc; i++) {
             
             if (i > optind && argc - optind > 1) {
-                printf("\n");
+                outbuf_put(&stdout_buf, "\n", 1);
             }
-            process_path(argv[i], show_all, long_format);
+            process_path(argv[i], &opts);
+            /* Ошибки следующего аргумента не должны обогнать этот вывод */
+            outbuf_flush(&stdout_buf);
         }
     }
 
+    outbuf_flush(&stdout_buf);
+    outbuf_free(&stdout_buf);
     return 0;
 }
 
 
-int compare_entries(const void *a, const void *b) {
-    const FileEntry *entry_a = (const FileEntry *)a;
-    const FileEntry *entry_b = (const FileEntry *)b;
-    return strcmp(entry_a->name, entry_b->name);
+static int compare_items(const FileEntry *entries, const SortItem *a, const SortItem *b, size_t depth) {
+    int c = strcmp((const char *)a->key + depth, (const char *)b->key + depth);
+    return c != 0 ? c : strcmp(entries[a->index].name, entries[b->index].name);
+}
+
+static void insertion_sort_items(const FileEntry *entries, SortItem *items, int n, size_t depth) {
+    for (int i = 1; i < n; i++) {
+        SortItem item = items[i];
+        int j = i;
+        while (j > 0 && compare_items(entries, &item, &items[j - 1], depth) < 0) {
+            items[j] = items[j - 1];
+            j--;
+        }
+        items[j] = item;
+    }
+}
+
+static void swap_items(SortItem *items, int i, int j) {
+    SortItem tmp = items[i];
+    items[i] = items[j];
+    items[j] = tmp;
+}
+
+/* Восемь байт ключа с позиции depth как число; после конца строки — нули */
+static uint64_t key_word(const unsigned char *key, size_t depth) {
+    uint64_t word = 0;
+    for (int i = 0; i < 8; i++) {
+        unsigned char c = key[depth + i];
+        word |= (uint64_t)c << (56 - 8 * i);
+        if (c == 0) break;
+    }
+    return word;
+}
+
+/*
+ * Многоключевая быстрая сортировка (Bentley, Sedgewick) по словам из восьми
+ * байт ключа. Слово читается из ключа один раз на уровень и лежит в самой
+ * записи, так что разбиение идёт по массиву подряд, без прыжков по памяти.
+ */
+static void multikey_sort(const FileEntry *entries, SortItem *items, int n, size_t depth, int loaded) {
+    while (n > SORT_INSERTION_MAX) {
+        if (!loaded) {
+            for (int i = 0; i < n; i++) items[i].word = key_word(items[i].key, depth);
+        }
+        uint64_t a = items[0].word, b = items[n / 2].word, c = items[n - 1].word;
+        uint64_t pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+
+        /* [0, lt) < pivot, [lt, i) == pivot, (gt, n) > pivot */
+        int lt = 0, i = 0, gt = n - 1;
+        while (i <= gt) {
+            uint64_t w = items[i].word;
+            if (w < pivot) {
+                swap_items(items, lt++, i++);
+            } else if (w > pivot) {
+                swap_items(items, i, gt--);
+            } else {
+                i++;
+            }
+        }
+
+        multikey_sort(entries, items, lt, depth, 1);
+        multikey_sort(entries, items + gt + 1, n - gt - 1, depth, 1);
+        if ((pivot & 0xff) == 0) {
+            /* Ключи совпали целиком: порядок решают сами имена */
+            insertion_sort_items(entries, items + lt, gt + 1 - lt, depth);
+            return;
+        }
+        items += lt;
+        n = gt + 1 - lt;
+        depth += 8;
+        loaded = 0;
+    }
+    insertion_sort_items(entries, items, n, depth);
 }
 
-void process_path(const char *path, int show_all, int long_format) {
+/* Устойчивая поразрядная сортировка по num, по байту за проход; результат в items */
+static void radix_sort_items(SortItem *items, SortItem *tmp, int n) {
+    SortItem *src = items, *dst = tmp;
+    for (int shift = 0; shift < 64; shift += 8) {
+        int counts[256] = { 0 };
+        for (int i = 0; i < n; i++) counts[(src[i].num >> shift) & 0xff]++;
+        /* Старшие байты времени и размера обычно у всех одинаковые */
+        if (counts[(src[0].num >> shift) & 0xff] == n) continue;
+        int sum = 0;
+        for (int d = 0; d < 256; d++) {
+            int c = counts[d];
+            counts[d] = sum;
+            sum += c;
+        }
+        for (int i = 0; i < n; i++) dst[counts[(src[i].num >> shift) & 0xff]++] = src[i];
+        SortItem *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != items) memcpy(items, src, (size_t)n * sizeof(SortItem));
+}
+
+static uint64_t descending_key(int64_t value) {
+    return ~((uint64_t)value ^ (UINT64_C(1) << 63));
+}
+
+/*
+ * Сортирует записи по имени (в порядке локали), а для -t/-S — по времени
+ * или размеру от большего к меньшему; при равенстве решает имя. -r переворачивает.
+ */
+void sort_entries(FileEntry *entries, int count, const ListOptions *opts, NameArena *arena) {
+    if (count < 2) return;
+
+    SortItem *items = malloc(2 * (size_t)count * sizeof(SortItem));
+    FileEntry *sorted = malloc((size_t)count * sizeof(FileEntry));
+    if (items == NULL || sorted == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    const char *collate = setlocale(LC_COLLATE, NULL);
+    int c_locale = collate == NULL || strcmp(collate, "C") == 0 || strcmp(collate, "POSIX") == 0;
+
+    for (int i = 0; i < count; i++) {
+        const char *name = entries[i].name;
+        items[i].index = i;
+        if (c_locale) {
+            items[i].key = (const unsigned char *)name;
+        } else {
+            size_t len = strxfrm(NULL, name, 0);
+            char *key = arena_alloc(arena, len + 1);
+            strxfrm(key, name, len + 1);
+            items[i].key = (const unsigned char *)key;
+        }
+        if (opts->sort == SORT_TIME) {
+            /* Наносекунды в int64 хватает на ±292 года от эпохи */
+            items[i].num = descending_key((int64_t)entries[i].mtime * 1000000000 + entries[i].mtime_nsec);
+        } else if (opts->sort == SORT_SIZE) {
+            items[i].num = descending_key(entries[i].size);
+        }
+    }
+
+    multikey_sort(entries, items, count, 0, 0);
+    if (opts->sort != SORT_NAME) {
+        radix_sort_items(items, items + count, count);
+    }
+
+    for (int i = 0; i < count; i++) {
+        int from = opts->reverse ? items[count - 1 - i].index : items[i].index;
+        sorted[i] = entries[from];
+    }
+    memcpy(entries, sorted, (size_t)count * sizeof(FileEntry));
+    free(sorted);
+    free(items);
+}
+
+void process_path(const char *path, const ListOptions *opts) {
     struct stat path_st;
     if (lstat(path, &path_st) == -1) {
         perror(path);
@@ -82,171 +543,1345 @@ void process_path(const char *path, int show_all, int long_format) {
     
     if (!S_ISDIR(path_st.st_mode)) {
         FileEntry entry;
-        strncpy(entry.name, path, sizeof(entry.name) - 1);
-        entry.st = path_st;
+        entry.name = path;
+        fill_entry(&entry, &path_st);
 
-        if (long_format) {
-            print_long_format(path, &entry);
+        if (opts->long_format) {
+            RowFormat fmt;
+            prepare_row_format(&fmt, &entry, 1);
+            print_long_format(&stdout_buf, &fmt, AT_FDCWD, &entry);
         } else {
-            print_short_format(&entry);
-            printf("\n");
+            print_short_format(&stdout_buf, &entry);
+            outbuf_put(&stdout_buf, "\n", 1);
         }
         return;
     }
+
+    if (opts->recursive) {
+        walk_tree(path, opts);
+        return;
+    }
     
-    
-    
-    
-    DIR *dir = opendir(path);
-    if (dir == NULL) {
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
         perror(path);
         return;
     }
 
-    FileEntry *entries = NULL;
-    int count = 0;
-    struct dirent *dirent_p;
+    char *dirent_buf = malloc(DIRENT_BUF_SIZE);
+    if (dirent_buf == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    list_directory(dir_fd, path, opts, dirent_buf, STAT_THREADS_MAX, &stdout_buf, stderr, NULL);
+    free(dirent_buf);
+    close(dir_fd);
+}
 
-    
-    while ((dirent_p = readdir(dir)) != NULL) {
-        if (!show_all && dirent_p->d_name[0] == '.') {
+/* statx для пачки записей; записи, которые не удалось статить, выкидываются */
+static int stat_and_prune(int dir_fd, unsigned int mask, FileEntry *entries, int count,
+                          int stat_threads, const char *path, FILE *err) {
+    /* statx относительно открытого каталога: без сборки полного пути */
+    stat_entries(dir_fd, mask, entries, count, stat_threads);
+
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (entries[i].stat_errno != 0) {
+            fprintf(err, "%s/%s: %s\n", path, entries[i].name, strerror(entries[i].stat_errno));
             continue;
         }
+        if (kept != i) entries[kept] = entries[i];
+        kept++;
+    }
+    return kept;
+}
 
-        
-        entries = realloc(entries, (count + 1) * sizeof(FileEntry));
-        if (entries == NULL) {
-            perror("realloc");
-            closedir(dir);
+static void print_entries(OutBuf *out, int dir_fd, const FileEntry *entries, int count,
+                          int long_format, RowFormat *fmt) {
+    for (int i = 0; i < count; i++) {
+        if (long_format) {
+            print_long_format(out, fmt, dir_fd, &entries[i]);
+        } else {
+            print_short_format(out, &entries[i]);
+        }
+    }
+}
+
+static void collect_subdirs(NameList *subdirs, const FileEntry *entries, int count) {
+    for (int i = 0; i < count; i++) {
+        const char *name = entries[i].name;
+        if (!S_ISDIR(entries[i].mode)) continue;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        if (subdirs->count == subdirs->cap) {
+            subdirs->cap = subdirs->cap ? subdirs->cap * 2 : 16;
+            subdirs->names = realloc(subdirs->names, subdirs->cap * sizeof(char *));
+            if (subdirs->names == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        subdirs->names[subdirs->count] = strdup(name);
+        if (subdirs->names[subdirs->count] == NULL) {
+            perror("strdup");
             exit(EXIT_FAILURE);
         }
+        subdirs->count++;
+    }
+}
 
-        
-        FileEntry *current_entry = &entries[count];
-        strncpy(current_entry->name, dirent_p->d_name, sizeof(current_entry->name) - 1);
-        
-        char fullpath[1024];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", path, dirent_p->d_name);
+/*
+ * -U/-f: каталог печатается пачками по одному буферу getdents64, так что
+ * память не зависит от размера каталога и вывод начинается сразу.
+ * Ширины колонок -l считаются по пачке, а строку «итого» посчитать заранее
+ * нельзя, поэтому её нет.
+ */
+static void stream_directory(int dir_fd, const char *path, const ListOptions *opts,
+                             char *dirent_buf, int stat_threads, unsigned int mask,
+                             OutBuf *out, FILE *err, NameList *subdirs) {
+    EntryTable table = { NULL, 0, 0 };
+    int printed = 0;
+    int status;
 
-        if (lstat(fullpath, &current_entry->st) == -1) {
-            perror(fullpath);
-            
-            continue; 
+    do {
+        NameArena names = { NULL };
+        table.count = 0;
+        status = read_directory(dir_fd, opts->show_all, opts->long_format, 1, dirent_buf,
+                                &table, &names);
+        if (status == -1) {
+            fprintf(err, "%s: %s\n", path, strerror(errno));
         }
-        count++;
+
+        int count = stat_and_prune(dir_fd, mask, table.items, table.count, stat_threads, path, err);
+        RowFormat fmt;
+        if (opts->long_format) prepare_row_format(&fmt, table.items, count);
+        print_entries(out, dir_fd, table.items, count, opts->long_format, &fmt);
+        if (subdirs != NULL) collect_subdirs(subdirs, table.items, count);
+        printed += count;
+
+        arena_free(&names);
+        if (out->fd != -1) outbuf_flush(out);
+    } while (status == 1);
+
+    if (!opts->long_format && printed > 0) {
+        outbuf_put(out, "\n", 1);
+    }
+    free(table.items);
+}
+
+/*
+ * Печатает содержимое открытого каталога в out, ошибки — в err.
+ * Если subdirs не NULL, туда в порядке вывода попадают имена подкаталогов.
+ */
+void list_directory(int dir_fd, const char *path, const ListOptions *opts, char *dirent_buf,
+                    int stat_threads, OutBuf *out, FILE *err, NameList *subdirs) {
+    int long_format = opts->long_format;
+
+    /* Для -t и -S время и размер нужны и в коротком формате */
+    unsigned int mask = long_format ? STATX_LONG_MASK : STATX_SHORT_MASK;
+    if (opts->sort == SORT_TIME) mask |= STATX_MTIME;
+    if (opts->sort == SORT_SIZE) mask |= STATX_SIZE;
+    int full_stat = long_format || opts->sort == SORT_TIME || opts->sort == SORT_SIZE;
+
+    if (opts->sort == SORT_NONE) {
+        stream_directory(dir_fd, path, opts, dirent_buf, stat_threads, mask, out, err, subdirs);
+        return;
+    }
+
+    EntryTable table = { NULL, 0, 0 };
+    NameArena names = { NULL };
+    FileEntry *entries;
+    int count;
+
+    if (opts->cache) {
+        count = snapshot_refresh(dir_fd, path, dirent_buf, stat_threads, NULL, 0, &table, &names, err);
+        entries = table.items;
+        if (!opts->show_all) {
+            int kept = 0;
+            for (int i = 0; i < count; i++) {
+                if (entries[i].name[0] == '.') continue;
+                if (kept != i) entries[kept] = entries[i];
+                kept++;
+            }
+            count = kept;
+        }
+    } else {
+        if (read_directory(dir_fd, opts->show_all, full_stat, 0, dirent_buf, &table, &names) == -1) {
+            fprintf(err, "%s: %s\n", path, strerror(errno));
+        }
+        entries = table.items;
+        count = stat_and_prune(dir_fd, mask, entries, table.count, stat_threads, path, err);
     }
-    closedir(dir);
 
     
-    qsort(entries, count, sizeof(FileEntry), compare_entries);
+    sort_entries(entries, count, opts, &names);
 
     
+    RowFormat fmt;
     if (long_format) {
         long long total_blocks = 0;
         for (int i = 0; i < count; i++) {
-            total_blocks += (long long)entries[i].st.st_blocks;
+            total_blocks += (long long)entries[i].blocks;
         }
-        printf("итого %lld\n", total_blocks);
+        /* st_blocks в 512-байтных блоках, ls считает в килобайтах */
+        char total[64];
+        int len = snprintf(total, sizeof(total), "итого %lld\n", (total_blocks + 1) / 2);
+        outbuf_put(out, total, (size_t)len);
+        prepare_row_format(&fmt, entries, count);
     }
 
+    print_entries(out, dir_fd, entries, count, long_format, &fmt);
+
+    if (!long_format && count > 0) {
+        outbuf_put(out, "\n", 1);
+    }
+
+    if (subdirs != NULL) collect_subdirs(subdirs, entries, count);
+
+    free(entries); 
+    arena_free(&names);
+}
+
+/* Где лежат снимки: $MYLS_CACHE_DIR, иначе $XDG_CACHE_HOME/myls или ~/.cache/myls */
+static int snapshot_path(char *buf, size_t size, uint64_t dev, uint64_t ino, int create) {
+    char dir[768];
+    const char *env = getenv("MYLS_CACHE_DIR");
+    if (env != NULL && env[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s", env);
+    } else if ((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s/myls", env);
+    } else if ((env = getenv("HOME")) != NULL && env[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s/.cache/myls", env);
+    } else {
+        return -1;
+    }
+
+    if (create) {
+        /* Создаём недостающие каталоги по пути, как mkdir -p */
+        for (char *p = dir + 1; *p; p++) {
+            if (*p != '/') continue;
+            *p = '\0';
+            mkdir(dir, 0700);
+            *p = '/';
+        }
+        if (mkdir(dir, 0700) == -1 && errno != EEXIST) return -1;
+    }
+    snprintf(buf, size, "%s/%016llx-%016llx.snap", dir,
+             (unsigned long long)dev, (unsigned long long)ino);
+    return 0;
+}
+
+static int snapshot_key_matches(const SnapshotHeader *hdr, const struct stat *dir_st) {
+    return hdr->mtime_sec == (int64_t)dir_st->st_mtim.tv_sec &&
+           hdr->mtime_nsec == (uint32_t)dir_st->st_mtim.tv_nsec &&
+           hdr->ctime_sec == (int64_t)dir_st->st_ctim.tv_sec &&
+           hdr->ctime_nsec == (uint32_t)dir_st->st_ctim.tv_nsec;
+}
+
+/* Загружает снимок в table/names; -1, если снимка нет или он испорчен */
+static int snapshot_load(const struct stat *dir_st, SnapshotHeader *hdr,
+                         EntryTable *table, NameArena *names) {
+    char file[1024];
+    if (snapshot_path(file, sizeof(file), dir_st->st_dev, dir_st->st_ino, 0) == -1) return -1;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    char *data = NULL;
+    int ok = 0;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SnapshotHeader)) {
+        data = malloc(st.st_size);
+        if (data != NULL && read(fd, data, st.st_size) == st.st_size) {
+            memcpy(hdr, data, sizeof(*hdr));
+            size_t records = sizeof(SnapshotHeader) + (size_t)hdr->count * sizeof(SnapshotRecord);
+            ok = memcmp(hdr->magic, SNAPSHOT_MAGIC, 8) == 0 &&
+                 hdr->dev == (uint64_t)dir_st->st_dev && hdr->ino == (uint64_t)dir_st->st_ino &&
+                 records + hdr->names_size == (size_t)st.st_size &&
+                 (hdr->names_size == 0 || data[st.st_size - 1] == '\0');
+        }
+    }
+    close(fd);
+    if (!ok) {
+        free(data);
+        return -1;
+    }
+
+    const SnapshotRecord *rec = (const SnapshotRecord *)(data + sizeof(SnapshotHeader));
+    char *blob = arena_alloc(names, hdr->names_size ? hdr->names_size : 1);
+    memcpy(blob, (const char *)(rec + hdr->count), hdr->names_size);
+    for (uint32_t i = 0; i < hdr->count; i++) {
+        if (rec[i].name_off >= hdr->names_size) break;
+        FileEntry *e = table_push(table);
+        e->name = blob + rec[i].name_off;
+        e->ino = rec[i].ino;
+        e->mode = rec[i].mode;
+        e->nlink = rec[i].nlink;
+        e->uid = rec[i].uid;
+        e->gid = rec[i].gid;
+        e->size = (off_t)rec[i].size;
+        e->blocks = (blkcnt_t)rec[i].blocks;
+        e->mtime = (time_t)rec[i].mtime;
+        e->mtime_nsec = rec[i].mtime_nsec;
+        e->rdev_major = rec[i].rdev_major;
+        e->rdev_minor = rec[i].rdev_minor;
+    }
+    free(data);
+    return 0;
+}
+
+/* Пишет снимок во временный файл и атомарно подменяет им старый */
+static void snapshot_save(const struct stat *dir_st, const FileEntry *entries, int count) {
+    char file[1024], tmp[1100];
+    if (snapshot_path(file, sizeof(file), dir_st->st_dev, dir_st->st_ino, 1) == -1) return;
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", file, (long)getpid());
+
+    SnapshotHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, 8);
+    hdr.dev = dir_st->st_dev;
+    hdr.ino = dir_st->st_ino;
+    /* Слишком свежий ключ не сохраняем: следующий запуск всё равно перечитает */
+    time_t changed = dir_st->st_mtim.tv_sec > dir_st->st_ctim.tv_sec ? dir_st->st_mtim.tv_sec
+                                                                     : dir_st->st_ctim.tv_sec;
+    if (time(NULL) - changed >= SNAPSHOT_RACY_SEC) {
+        hdr.mtime_sec = dir_st->st_mtim.tv_sec;
+        hdr.mtime_nsec = dir_st->st_mtim.tv_nsec;
+        hdr.ctime_sec = dir_st->st_ctim.tv_sec;
+        hdr.ctime_nsec = dir_st->st_ctim.tv_nsec;
+    }
+    hdr.count = count;
+
+    SnapshotRecord *rec = calloc(count ? count : 1, sizeof(SnapshotRecord));
+    if (rec == NULL) return;
+    size_t names_size = 0;
     for (int i = 0; i < count; i++) {
-        char fullpath[1024];
-        snprintf(fullpath, sizeof(fullpath), "%s/%s", path, entries[i].name);
-        if (long_format) {
-            print_long_format(fullpath, &entries[i]);
-        } else {
-            print_short_format(&entries[i]);
+        const FileEntry *e = &entries[i];
+        rec[i].ino = e->ino;
+        rec[i].size = (uint64_t)e->size;
+        rec[i].blocks = (uint64_t)e->blocks;
+        rec[i].mtime = e->mtime;
+        rec[i].mtime_nsec = (uint32_t)e->mtime_nsec;
+        rec[i].mode = e->mode;
+        rec[i].nlink = (uint32_t)e->nlink;
+        rec[i].uid = e->uid;
+        rec[i].gid = e->gid;
+        rec[i].rdev_major = e->rdev_major;
+        rec[i].rdev_minor = e->rdev_minor;
+        rec[i].name_off = (uint32_t)names_size;
+        names_size += strlen(e->name) + 1;
+    }
+    hdr.names_size = (uint32_t)names_size;
+
+    OutBuf buf;
+    outbuf_init(&buf, open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (buf.fd == -1) {
+        free(rec);
+        return;
+    }
+    outbuf_put(&buf, (const char *)&hdr, sizeof(hdr));
+    outbuf_put(&buf, (const char *)rec, (size_t)count * sizeof(SnapshotRecord));
+    for (int i = 0; i < count; i++) {
+        outbuf_put(&buf, entries[i].name, strlen(entries[i].name) + 1);
+    }
+    outbuf_flush(&buf);
+    close(buf.fd);
+    outbuf_free(&buf);
+    free(rec);
+    if (rename(tmp, file) == -1) unlink(tmp);
+}
+
+static uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+/* Открытая адресация по именам: индекс в names или -1 в пустом слоте */
+static int *name_index_build(const char **names, int count, size_t *cap_out) {
+    size_t cap = 16;
+    while (cap < (size_t)count * 2) cap *= 2;
+    int *slots = malloc(cap * sizeof(int));
+    if (slots == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(slots, 0xff, cap * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        size_t j = hash_name(names[i]) & (cap - 1);
+        while (slots[j] != -1) j = (j + 1) & (cap - 1);
+        slots[j] = i;
+    }
+    *cap_out = cap;
+    return slots;
+}
+
+static int name_index_find(const int *slots, size_t cap, const char **names, const char *name) {
+    size_t j = hash_name(name) & (cap - 1);
+    while (slots[j] != -1 && strcmp(names[slots[j]], name) != 0) {
+        j = (j + 1) & (cap - 1);
+    }
+    return slots[j];
+}
+
+static int is_dot_entry(const char *name) {
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+/*
+ * Все записи каталога (включая скрытые) с полным stat, через снимок.
+ * Если каталог не менялся с момента снимка, записи берутся прямо из него,
+ * иначе каталог перечитывается и статятся только новые имена, имена со
+ * сменившимся inode и имена из dirty (их присылает --watch); с restat_all
+ * (очередь inotify переполнилась) статится всё. "." и ".." статятся всегда: ".." может поменяться без изменения самого каталога.
+ * Изменения содержимого файлов без --watch снимок не замечает.
+ */
+int snapshot_refresh(int dir_fd, const char *path, char *dirent_buf, int stat_threads,
+                     const NameList *dirty, int restat_all, EntryTable *table, NameArena *names,
+                     FILE *err) {
+    struct stat dir_st;
+    if (fstat(dir_fd, &dir_st) == -1) {
+        fprintf(err, "%s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    SnapshotHeader hdr;
+    EntryTable old = { NULL, 0, 0 };
+    NameArena old_names = { NULL };
+    int loaded = snapshot_load(&dir_st, &hdr, &old, &old_names) == 0;
+
+    if (loaded && dirty == NULL && !restat_all && snapshot_key_matches(&hdr, &dir_st)) {
+        for (int i = 0; i < old.count; i++) {
+            FileEntry *e = table_push(table);
+            *e = old.items[i];
+            e->name = arena_strdup(names, old.items[i].name, strlen(old.items[i].name));
+            e->need_stat = is_dot_entry(e->name);
         }
+        free(old.items);
+        arena_free(&old_names);
+        return stat_and_prune(dir_fd, STATX_LONG_MASK, table->items, table->count,
+                              stat_threads, path, err);
     }
 
-    if (!long_format && count > 0) {
-        printf("\n");
+    if (read_directory(dir_fd, 1, 1, 0, dirent_buf, table, names) == -1) {
+        fprintf(err, "%s: %s\n", path, strerror(errno));
     }
 
-    free(entries); 
+    if (loaded && old.count > 0 && !restat_all) {
+        const char **old_list = malloc(old.count * sizeof(char *));
+        if (old_list == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < old.count; i++) old_list[i] = old.items[i].name;
+
+        size_t old_cap, dirty_cap = 0;
+        int *old_index = name_index_build(old_list, old.count, &old_cap);
+        const char **dirty_list = dirty ? (const char **)dirty->names : NULL;
+        int *dirty_index = dirty ? name_index_build(dirty_list, dirty->count, &dirty_cap) : NULL;
+
+        for (int i = 0; i < table->count; i++) {
+            FileEntry *e = &table->items[i];
+            if (is_dot_entry(e->name)) continue;
+            if (dirty && name_index_find(dirty_index, dirty_cap, dirty_list, e->name) != -1) continue;
+            int k = name_index_find(old_index, old_cap, old_list, e->name);
+            if (k == -1 || old.items[k].ino != e->ino) continue;
+
+            const char *name = e->name;
+            ino_t ino = e->ino;
+            *e = old.items[k];
+            e->name = name;
+            e->ino = ino;
+            e->need_stat = 0;
+        }
+        free(old_index);
+        free(dirty_index);
+        free(old_list);
+    }
+    free(old.items);
+    arena_free(&old_names);
+
+    int count = stat_and_prune(dir_fd, STATX_LONG_MASK, table->items, table->count,
+                               stat_threads, path, err);
+    table->count = count;
+    snapshot_save(&dir_st, table->items, count);
+    return count;
 }
 
-void print_short_format(const FileEntry *entry) {
-    mode_t mode = entry->st.st_mode;
-    const char *name = entry->name;
+/* Оставить первое вхождение каждого имени */
+static void dedupe_names(NameList *list) {
+    size_t cap;
+    int *index = name_index_build((const char **)list->names, list->count, &cap);
+    char *keep = malloc(list->count);
+    if (keep == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    /* Линейное пробирование находит самое раннее из равных имён. Пока
+     * индекс в ходу, имена не освобождаются */
+    for (int i = 0; i < list->count; i++) {
+        keep[i] = name_index_find(index, cap, (const char **)list->names, list->names[i]) == i;
+    }
+    free(index);
+
+    int kept = 0;
+    for (int i = 0; i < list->count; i++) {
+        if (keep[i]) list->names[kept++] = list->names[i];
+        else free(list->names[i]);
+    }
+    free(keep);
+    list->count = kept;
+}
+
+/* Повторы выбрасываются, только когда список заполнен: всплеск событий
+ * по одним и тем же именам не растит его */
+static void add_name(NameList *list, const char *name) {
+    if (list->count == list->cap) {
+        if (list->count > 0) dedupe_names(list);
+        /* растём, если повторы освободили меньше половины */
+        if (list->cap == 0 || list->count * 2 > list->cap) {
+            list->cap = list->cap ? list->cap * 2 : 16;
+            list->names = realloc(list->names, list->cap * sizeof(char *));
+            if (list->names == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    list->names[list->count] = strdup(name);
+    if (list->names[list->count] == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    list->count++;
+}
+
+/*
+ * --watch: держит снимок каталога свежим. События inotify копятся, пока
+ * не наступит пауза в WATCH_DEBOUNCE_MS, после чего перестатятся только
+ * упомянутые в них имена.
+ */
+int watch_directory(const char *path) {
+    int in_fd = inotify_init1(IN_CLOEXEC);
+    if (in_fd == -1) {
+        perror("inotify_init1");
+        return EXIT_FAILURE;
+    }
+    uint32_t events = IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                      IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+    if (inotify_add_watch(in_fd, path, events) == -1) {
+        perror(path);
+        close(in_fd);
+        return EXIT_FAILURE;
+    }
+
+    char *dirent_buf = malloc(DIRENT_BUF_SIZE);
+    char *event_buf = malloc(64 * 1024);
+    if (dirent_buf == NULL || event_buf == NULL) {
+        perror("malloc");
+        free(dirent_buf);
+        free(event_buf);
+        close(in_fd);
+        return EXIT_FAILURE;
+    }
+
+    NameList dirty = { NULL, 0, 0 };
+    int restat_all = 0;
+    int status = 0;
+    int alive = 1;
+    while (alive) {
+        /* Каталог открывается только на время обновления: пока он открыт,
+         * удаление не присылает IN_DELETE_SELF */
+        int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd == -1) {
+            perror(path);
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        EntryTable table = { NULL, 0, 0 };
+        NameArena names = { NULL };
+        snapshot_refresh(dir_fd, path, dirent_buf, STAT_THREADS_MAX, &dirty, restat_all,
+                         &table, &names, stderr);
+        close(dir_fd);
+        free(table.items);
+        arena_free(&names);
+        for (int i = 0; i < dirty.count; i++) free(dirty.names[i]);
+        dirty.count = 0;
+        restat_all = 0;
 
-    if (S_ISDIR(mode)) {
-        printf("%s%s%s  ", COLOR_BLUE, name, COLOR_RESET);
-    } else if (S_ISLNK(mode)) {
-        printf("%s%s%s  ", COLOR_CYAN, name, COLOR_RESET);
-    } else if (mode & (S_IXUSR | S_IXGRP | S_IXOTH)) { 
-        printf("%s%s%s  ", COLOR_GREEN, name, COLOR_RESET);
+        int timeout = -1;
+        for (;;) {
+            struct pollfd pfd = { in_fd, POLLIN, 0 };
+            int ready = poll(&pfd, 1, timeout);
+            if (ready == -1 && errno == EINTR) continue;
+            if (ready <= 0) break;
+
+            ssize_t n = read(in_fd, event_buf, 64 * 1024);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) {
+                alive = 0;
+                break;
+            }
+            for (ssize_t off = 0; off < n; ) {
+                struct inotify_event *ev = (struct inotify_event *)(event_buf + off);
+                off += sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) alive = 0;
+                /* События потеряны: какие имена менялись, уже не узнать */
+                if (ev->mask & IN_Q_OVERFLOW) restat_all = 1;
+                if (ev->len > 0 && !restat_all) add_name(&dirty, ev->name);
+            }
+            if (!alive) break;
+            timeout = WATCH_DEBOUNCE_MS;
+        }
+    }
+
+    for (int i = 0; i < dirty.count; i++) free(dirty.names[i]);
+    free(dirty.names);
+    free(event_buf);
+    free(dirent_buf);
+    close(in_fd);
+    return status;
+}
+
+static void deque_push(WalkDeque *dq, WalkNode *node) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom == dq->cap) {
+        if (dq->top > 0) {
+            memmove(dq->items, dq->items + dq->top, (dq->bottom - dq->top) * sizeof(WalkNode *));
+            dq->bottom -= dq->top;
+            dq->top = 0;
+        }
+        if (dq->bottom == dq->cap) {
+            dq->cap = dq->cap ? dq->cap * 2 : 64;
+            dq->items = realloc(dq->items, dq->cap * sizeof(WalkNode *));
+            if (dq->items == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    dq->items[dq->bottom++] = node;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static WalkNode *deque_take(WalkDeque *dq, int steal) {
+    WalkNode *node = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        node = steal ? dq->items[dq->top++] : dq->items[--dq->bottom];
+        if (dq->top == dq->bottom) dq->top = dq->bottom = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return node;
+}
+
+/*
+ * Сначала своя очередь (в глубину, как и печать), потом чужие сверху.
+ * Каталог, который главный поток уже прочитал сам, пропускается; если он
+ * и напечатан, освобождать его — забота того, кто достал его из очереди.
+ */
+static WalkNode *walk_take(Walker *walker, int id) {
+    for (;;) {
+        WalkNode *node = deque_take(&walker->deques[id], 0);
+        for (int k = 1; node == NULL && k < walker->nworkers; k++) {
+            node = deque_take(&walker->deques[(id + k) % walker->nworkers], 1);
+        }
+        if (node == NULL) return NULL;
+
+        pthread_mutex_lock(&walker->lock);
+        walker->queued--;
+        node->queued = 0;
+        int claimed = node->claimed;
+        int printed = node->printed;
+        node->claimed = 1;
+        pthread_mutex_unlock(&walker->lock);
+        if (printed) free(node);
+        if (!claimed) return node;
+    }
+}
+
+static WalkNode *walk_node_new(char *path, int fd) {
+    WalkNode *node = calloc(1, sizeof(WalkNode));
+    if (node == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    node->path = path;
+    node->fd = fd;
+    node->queued = 1;
+    return node;
+}
+
+static void walk_process(Walker *walker, int id, WalkNode *node, char *dirent_buf) {
+    FILE *err = open_memstream(&node->err, &node->err_len);
+    outbuf_init(&node->out, -1);
+    if (err == NULL) {
+        perror("open_memstream");
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = node->fd;
+    if (fd == -1) {
+        /* Каталог могли подменить ссылкой после readdir родителя */
+        fd = open(node->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (node->follow ? 0 : O_NOFOLLOW));
+        if (fd != -1) __atomic_fetch_add(&walker->fds_open, 1, __ATOMIC_RELAXED);
+    }
+
+    NameList subdirs = { NULL, 0, 0 };
+    if (fd == -1) {
+        fprintf(err, "%s: %s\n", node->path, strerror(errno));
     } else {
-        printf("%s  ", name);
+        list_directory(fd, node->path, walker->opts, dirent_buf, 1, &node->out, err, &subdirs);
+    }
+    fclose(err);
+
+    if (subdirs.count > 0) {
+        node->children = malloc(subdirs.count * sizeof(WalkNode *));
+        if (node->children == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t path_len = strlen(node->path);
+    int slash = path_len > 0 && node->path[path_len - 1] == '/';
+    for (int i = 0; i < subdirs.count; i++) {
+        const char *name = subdirs.names[i];
+        size_t len = path_len + strlen(name) + 2;
+        char *child_path = malloc(len);
+        if (child_path == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(child_path, len, slash ? "%s%s" : "%s/%s", node->path, name);
+
+        /* Пока есть запас дескрипторов, открываем детей через openat, иначе — по пути */
+        int child_fd = -1;
+        if (__atomic_fetch_add(&walker->fds_open, 1, __ATOMIC_RELAXED) < walker->fds_max) {
+            child_fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        if (child_fd == -1) __atomic_fetch_sub(&walker->fds_open, 1, __ATOMIC_RELAXED);
+
+        node->children[i] = walk_node_new(child_path, child_fd);
+        free(subdirs.names[i]);
     }
+    node->nchildren = subdirs.count;
+    free(subdirs.names);
+
+    if (fd != -1) {
+        close(fd);
+        __atomic_fetch_sub(&walker->fds_open, 1, __ATOMIC_RELAXED);
+    }
+
+    /* В обратном порядке, чтобы первым снизу оказался первый подкаталог */
+    for (int i = node->nchildren - 1; i >= 0; i--) {
+        deque_push(&walker->deques[id], node->children[i]);
+    }
+
+    pthread_mutex_lock(&walker->lock);
+    walker->queued += node->nchildren;
+    walker->pending += node->nchildren - 1;
+    walker->buffered++;
+    node->done = 1;
+    pthread_cond_broadcast(&walker->done_cond);
+    pthread_cond_broadcast(&walker->work_cond);
+    pthread_mutex_unlock(&walker->lock);
 }
 
-void print_long_format(const char *path, const FileEntry *entry) {
-    struct stat sb = entry->st;
-    const char *name = entry->name;
-    
-    print_file_type(sb.st_mode);
-    print_permissions(sb.st_mode);
+static void *walk_worker(void *arg) {
+    WalkWorker *self = arg;
+    Walker *walker = self->walker;
+    char *dirent_buf = malloc(DIRENT_BUF_SIZE);
+    if (dirent_buf == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
 
-    
-    printf(" %2lu", (unsigned long)sb.st_nlink);
+    for (;;) {
+        /* Не уходить далеко вперёд печати: готовые листинги держатся в памяти */
+        pthread_mutex_lock(&walker->lock);
+        while (walker->pending > 0 && (walker->queued == 0 || walker->buffered >= WALK_AHEAD_MAX)) {
+            pthread_cond_wait(&walker->work_cond, &walker->lock);
+        }
+        int finished = walker->pending == 0;
+        pthread_mutex_unlock(&walker->lock);
+        if (finished) break;
+
+        WalkNode *node = walk_take(walker, self->id);
+        if (node != NULL) {
+            walk_process(walker, self->id, node, dirent_buf);
+        }
+    }
+
+    free(dirent_buf);
+    return NULL;
+}
 
-    struct passwd *pw = getpwuid(sb.st_uid);
-    struct group *gr = getgrgid(sb.st_gid);
-    char uid_buf[32];
-    char gid_buf[32];
-    snprintf(uid_buf, sizeof(uid_buf), "%lu", (unsigned long)sb.st_uid);
-    snprintf(gid_buf, sizeof(gid_buf), "%lu", (unsigned long)sb.st_gid);
-    printf(" %-8s %-8s", pw ? pw->pw_name : uid_buf, gr ? gr->gr_name : gid_buf);
+/*
+ * Печать в порядке обхода в глубину. Каталог, до которого рабочие ещё не
+ * дошли, главный поток читает сам: рабочие могут стоять на WALK_AHEAD_MAX.
+ */
+static void walk_print(Walker *walker, WalkNode *node, int first) {
+    pthread_mutex_lock(&walker->lock);
+    int mine = !node->claimed;
+    node->claimed = 1;
+    while (!mine && !node->done) {
+        pthread_cond_wait(&walker->done_cond, &walker->lock);
+    }
+    pthread_mutex_unlock(&walker->lock);
+    if (mine) walk_process(walker, 0, node, walker->print_buf);
 
-    printf(" %7lld", (long long)sb.st_size);
+    if (!first) outbuf_put(&stdout_buf, "\n", 1);
+    outbuf_put(&stdout_buf, node->path, strlen(node->path));
+    outbuf_put(&stdout_buf, ":\n", 2);
+    outbuf_put(&stdout_buf, node->out.data, node->out.len);
+    if (node->err_len > 0) {
+        outbuf_flush(&stdout_buf);
+        fwrite(node->err, 1, node->err_len, stderr);
+    }
+    outbuf_free(&node->out);
+    free(node->err);
 
-    char time_buf[20];
-    strftime(time_buf, sizeof(time_buf), "%b %d %H:%M", localtime(&sb.st_mtime));
-    printf(" %s ", time_buf);
+    pthread_mutex_lock(&walker->lock);
+    walker->buffered--;
+    pthread_cond_broadcast(&walker->work_cond);
+    pthread_mutex_unlock(&walker->lock);
 
-    
-    if (S_ISDIR(sb.st_mode)) {
-        printf("%s%s%s", COLOR_BLUE, name, COLOR_RESET);
-    } else if (S_ISLNK(sb.st_mode)) {
-        char link_target[1024];
-        ssize_t len = readlink(path, link_target, sizeof(link_target) - 1);
-        if (len != -1) {
-            link_target[len] = '\0';
-            printf("%s%s%s -> %s", COLOR_CYAN, name, COLOR_RESET, link_target);
-        } else {
-            printf("%s%s%s", COLOR_CYAN, name, COLOR_RESET);
+    for (int i = 0; i < node->nchildren; i++) {
+        walk_print(walker, node->children[i], 0);
+    }
+    free(node->children);
+    free(node->path);
+
+    pthread_mutex_lock(&walker->lock);
+    int queued = node->queued;
+    node->printed = 1;
+    pthread_mutex_unlock(&walker->lock);
+    if (!queued) free(node);
+}
+
+/*
+ * Рекурсивный обход для -R. Каталоги читают рабочие потоки, у каждого своя
+ * очередь; простаивающий поток ворует работу у соседей. Вывод детерминирован:
+ * главный поток печатает готовые листинги в порядке обхода.
+ */
+void walk_tree(const char *path, const ListOptions *opts) {
+    Walker walker;
+    memset(&walker, 0, sizeof(walker));
+    walker.opts = opts;
+    pthread_mutex_init(&walker.lock, NULL);
+    pthread_cond_init(&walker.work_cond, NULL);
+    pthread_cond_init(&walker.done_cond, NULL);
+
+    struct rlimit rl;
+    walker.fds_max = WALK_FDS_MAX;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+        rl.rlim_cur / 2 < (rlim_t)walker.fds_max) {
+        walker.fds_max = (int)(rl.rlim_cur / 2);
+    }
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    walker.nworkers = ncpu > 1 ? (int)ncpu : 1;
+    if (walker.nworkers > STAT_THREADS_MAX) walker.nworkers = STAT_THREADS_MAX;
+    walker.deques = calloc(walker.nworkers, sizeof(WalkDeque));
+    pthread_t *threads = calloc(walker.nworkers, sizeof(pthread_t));
+    WalkWorker *workers = calloc(walker.nworkers, sizeof(WalkWorker));
+    char *root_path = strdup(path);
+    walker.print_buf = malloc(DIRENT_BUF_SIZE);
+    if (walker.deques == NULL || threads == NULL || workers == NULL || root_path == NULL ||
+        walker.print_buf == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < walker.nworkers; i++) {
+        pthread_mutex_init(&walker.deques[i].lock, NULL);
+    }
+
+    WalkNode *root = walk_node_new(root_path, -1);
+    root->follow = 1;
+    deque_push(&walker.deques[0], root);
+    walker.queued = 1;
+    walker.pending = 1;
+
+    int started = 0;
+    for (int i = 0; i < walker.nworkers; i++) {
+        workers[i].walker = &walker;
+        workers[i].id = i;
+        if (pthread_create(&threads[i], NULL, walk_worker, &workers[i]) != 0) break;
+        started++;
+    }
+    if (started == 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    walk_print(&walker, root, 1);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < walker.nworkers; i++) {
+        /* Остались только каталоги, прочитанные и напечатанные главным потоком */
+        WalkDeque *dq = &walker.deques[i];
+        for (int k = dq->top; k < dq->bottom; k++) free(dq->items[k]);
+        free(dq->items);
+        pthread_mutex_destroy(&dq->lock);
+    }
+    free(walker.deques);
+    free(walker.print_buf);
+    free(threads);
+    free(workers);
+    pthread_cond_destroy(&walker.done_cond);
+    pthread_cond_destroy(&walker.work_cond);
+    pthread_mutex_destroy(&walker.lock);
+}
+
+static void *stat_worker(void *arg) {
+    StatJob *job = arg;
+
+    for (;;) {
+        int start = __atomic_fetch_add(&job->next, STAT_CHUNK, __ATOMIC_RELAXED);
+        if (start >= job->count) break;
+        int end = start + STAT_CHUNK < job->count ? start + STAT_CHUNK : job->count;
+        for (int i = start; i < end; i++) {
+            FileEntry *e = &job->entries[i];
+            struct statx stx;
+            if (!e->need_stat) continue;
+            if (statx(job->dir_fd, e->name, AT_SYMLINK_NOFOLLOW, job->mask, &stx) == -1) {
+                e->stat_errno = errno;
+            } else {
+                fill_entry_statx(e, &stx);
+            }
         }
-    } else if (sb.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) {
-        printf("%s%s%s", COLOR_GREEN, name, COLOR_RESET);
+    }
+    return NULL;
+}
+
+/*
+ * Читает каталог большими пачками getdents64. Тип файла берётся из d_type,
+ * поэтому в коротком формате stat нужен только обычным файлам (ради бита
+ * исполнения) и файловым системам, которые d_type не заполняют.
+ * С one_batch читает одну пачку: 1 — есть ещё, 0 — каталог кончился.
+ */
+int read_directory(int dir_fd, int show_all, int full_stat, int one_batch, char *buf,
+                   EntryTable *table, NameArena *names) {
+    for (;;) {
+        ssize_t n = getdents64(dir_fd, buf, DIRENT_BUF_SIZE);
+        if (n == -1) return -1;
+        if (n == 0) return 0;
+
+        for (ssize_t off = 0; off < n; ) {
+            struct dirent64 *d = (struct dirent64 *)(buf + off);
+            off += d->d_reclen;
+            if (!show_all && d->d_name[0] == '.') {
+                continue;
+            }
+
+            FileEntry *current_entry = table_push(table);
+            current_entry->name = arena_strdup(names, d->d_name, strlen(d->d_name));
+            current_entry->ino = d->d_ino;
+            current_entry->mode = DTTOIF(d->d_type);
+            current_entry->need_stat = full_stat || d->d_type == DT_UNKNOWN || d->d_type == DT_REG;
+        }
+        if (one_batch) return 1;
+    }
+}
+
+/* Статит записи каталога; на больших каталогах раздаёт их потокам порциями */
+void stat_entries(int dir_fd, unsigned int mask, FileEntry *entries, int count, int max_threads) {
+    StatJob job = { dir_fd, mask, entries, count, 0 };
+    pthread_t threads[STAT_THREADS_MAX];
+    int nthreads = 0;
+
+    int pending = 0;
+    for (int i = 0; i < count; i++) {
+        pending += entries[i].need_stat;
+    }
+    if (pending == 0) return;
+
+    if (pending >= STAT_PARALLEL_MIN) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        int want = ncpu > 1 ? (int)ncpu : 1;
+        if (want > max_threads) want = max_threads;
+        /* Текущий поток тоже работает, поэтому создаём на один меньше */
+        for (int i = 0; i < want - 1; i++) {
+            if (pthread_create(&threads[nthreads], NULL, stat_worker, &job) != 0) break;
+            nthreads++;
+        }
+    }
+
+    stat_worker(&job);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void fill_entry(FileEntry *entry, const struct stat *st) {
+    entry->mode = st->st_mode;
+    entry->nlink = st->st_nlink;
+    entry->uid = st->st_uid;
+    entry->gid = st->st_gid;
+    entry->size = st->st_size;
+    entry->blocks = st->st_blocks;
+    entry->mtime = st->st_mtime;
+    entry->mtime_nsec = st->st_mtim.tv_nsec;
+    entry->rdev_major = major(st->st_rdev);
+    entry->rdev_minor = minor(st->st_rdev);
+    entry->stat_errno = 0;
+}
+
+void fill_entry_statx(FileEntry *entry, const struct statx *stx) {
+    entry->mode = stx->stx_mode;
+    entry->nlink = stx->stx_nlink;
+    entry->uid = stx->stx_uid;
+    entry->gid = stx->stx_gid;
+    entry->size = (off_t)stx->stx_size;
+    entry->blocks = (blkcnt_t)stx->stx_blocks;
+    entry->mtime = (time_t)stx->stx_mtime.tv_sec;
+    entry->mtime_nsec = stx->stx_mtime.tv_nsec;
+    entry->rdev_major = stx->stx_rdev_major;
+    entry->rdev_minor = stx->stx_rdev_minor;
+    entry->stat_errno = 0;
+}
+
+char *arena_alloc(NameArena *arena, size_t len) {
+    NameBlock *block = arena->head;
+    if (block == NULL || block->cap - block->used < len) {
+        size_t cap = len > NAME_BLOCK_SIZE ? len : NAME_BLOCK_SIZE;
+        block = malloc(sizeof(NameBlock) + cap);
+        if (block == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        block->next = arena->head;
+        block->used = 0;
+        block->cap = cap;
+        arena->head = block;
+    }
+    char *ptr = block->data + block->used;
+    block->used += len;
+    return ptr;
+}
+
+const char *arena_strdup(NameArena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void arena_free(NameArena *arena) {
+    while (arena->head != NULL) {
+        NameBlock *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
+/* Геометрический рост: realloc на каждую запись копировал таблицу квадратично */
+FileEntry *table_push(EntryTable *table) {
+    if (table->count == table->cap) {
+        int new_cap = table->cap ? table->cap * 2 : 64;
+        FileEntry *items = realloc(table->items, (size_t)new_cap * sizeof(FileEntry));
+        if (items == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        table->items = items;
+        table->cap = new_cap;
+    }
+    FileEntry *entry = &table->items[table->count++];
+    memset(entry, 0, sizeof(*entry));
+    return entry;
+}
+
+static unsigned int hash_id(unsigned int id) {
+    id ^= id >> 16;
+    id *= 0x45d9f3bU;
+    id ^= id >> 16;
+    return id;
+}
+
+/* Имя пользователя или группы; если его нет в базе — число, как у ls */
+const char *cached_name(NameCache *cache, unsigned int id, int is_group) {
+    pthread_mutex_lock(&name_cache_lock);
+    if (cache->used * 2 >= cache->cap) {
+        size_t new_cap = cache->cap ? cache->cap * 2 : 64;
+        NameSlot *slots = calloc(new_cap, sizeof(NameSlot));
+        if (slots == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < cache->cap; i++) {
+            if (cache->slots[i].name == NULL) continue;
+            size_t j = hash_id(cache->slots[i].id) & (new_cap - 1);
+            while (slots[j].name != NULL) j = (j + 1) & (new_cap - 1);
+            slots[j] = cache->slots[i];
+        }
+        free(cache->slots);
+        cache->slots = slots;
+        cache->cap = new_cap;
+    }
+
+    size_t j = hash_id(id) & (cache->cap - 1);
+    while (cache->slots[j].name != NULL) {
+        if (cache->slots[j].id == id) {
+            pthread_mutex_unlock(&name_cache_lock);
+            return cache->slots[j].name;
+        }
+        j = (j + 1) & (cache->cap - 1);
+    }
+
+    const char *found = NULL;
+    if (is_group) {
+        struct group *gr = getgrgid(id);
+        if (gr) found = gr->gr_name;
     } else {
-        printf("%s", name);
+        struct passwd *pw = getpwuid(id);
+        if (pw) found = pw->pw_name;
+    }
+
+    char num_buf[32];
+    if (found == NULL) {
+        snprintf(num_buf, sizeof(num_buf), "%u", id);
+        found = num_buf;
     }
+    char *name = strdup(found);
+    if (name == NULL) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    cache->slots[j].id = id;
+    cache->slots[j].name = name;
+    cache->used++;
+    pthread_mutex_unlock(&name_cache_lock);
+    return name;
+}
+
+void outbuf_init(OutBuf *out, int fd) {
+    out->fd = fd;
+    out->data = NULL;
+    out->len = 0;
+    out->cap = 0;
+}
+
+void outbuf_flush(OutBuf *out) {
+    size_t done = 0;
+    while (out->fd != -1 && done < out->len) {
+        ssize_t w = write(out->fd, out->data + done, out->len - done);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        done += (size_t)w;
+    }
+    if (out->fd != -1) out->len = 0;
+}
+
+/* Место под len байт; буфер stdout сбрасывается большими кусками */
+static char *outbuf_reserve(OutBuf *out, size_t len) {
+    if (out->fd != -1 && out->len + len > out->cap && out->len > 0) {
+        outbuf_flush(out);
+    }
+    if (out->len + len > out->cap) {
+        size_t cap = out->cap ? out->cap : OUTBUF_SIZE;
+        while (cap < out->len + len) cap *= 2;
+        char *data = realloc(out->data, cap);
+        if (data == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        out->data = data;
+        out->cap = cap;
+    }
+    return out->data + out->len;
+}
 
-    printf("\n");
+void outbuf_put(OutBuf *out, const char *data, size_t len) {
+    memcpy(outbuf_reserve(out, len), data, len);
+    out->len += len;
 }
 
-void print_file_type(mode_t mode) {
+static void outbuf_pad(OutBuf *out, int count) {
+    if (count <= 0) return;
+    memset(outbuf_reserve(out, (size_t)count), ' ', (size_t)count);
+    out->len += (size_t)count;
+}
+
+/* Число, выровненное вправо по ширине width */
+static void outbuf_number(OutBuf *out, unsigned long long value, int width) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[sizeof(digits) - 1 - n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    outbuf_pad(out, width - n);
+    outbuf_put(out, digits + sizeof(digits) - n, (size_t)n);
+}
+
+void outbuf_free(OutBuf *out) {
+    free(out->data);
+    outbuf_init(out, out->fd);
+}
+
+void init_mode_table(void) {
+    static const char rwx[] = "rwx";
+    for (int mode = 0; mode < 4096; mode++) {
+        char *m = mode_table[mode];
+        for (int bit = 0; bit < 9; bit++) {
+            m[bit] = (mode & (0400 >> bit)) ? rwx[bit % 3] : '-';
+        }
+        if (mode & S_ISUID) m[2] = (mode & S_IXUSR) ? 's' : 'S';
+        if (mode & S_ISGID) m[5] = (mode & S_IXGRP) ? 's' : 'S';
+        if (mode & S_ISVTX) m[8] = (mode & S_IXOTH) ? 't' : 'T';
+    }
+}
+
+static char file_type_char(mode_t mode) {
     switch (mode & S_IFMT) {
-        case S_IFREG:  printf("-"); break;
-        case S_IFDIR:  printf("d"); break;
-        case S_IFLNK:  printf("l"); break;
-        case S_IFCHR:  printf("c"); break;
-        case S_IFBLK:  printf("b"); break;
-        case S_IFIFO:  printf("p"); break;
-        case S_IFSOCK: printf("s"); break;
-        default:       printf("?"); break;
-    }
-}
-
-void print_permissions(mode_t mode) {
-    printf((mode & S_IRUSR) ? "r" : "-");
-    printf((mode & S_IWUSR) ? "w" : "-");
-    printf((mode & S_IXUSR) ? "x" : "-");
-    printf((mode & S_IRGRP) ? "r" : "-");
-    printf((mode & S_IWGRP) ? "w" : "-");
-    printf((mode & S_IXGRP) ? "x" : "-");
-    printf((mode & S_IROTH) ? "r" : "-");
-    printf((mode & S_IWOTH) ? "w" : "-");
-    printf((mode & S_IXOTH) ? "x" : "-");
+        case S_IFREG:  return '-';
+        case S_IFDIR:  return 'd';
+        case S_IFLNK:  return 'l';
+        case S_IFCHR:  return 'c';
+        case S_IFBLK:  return 'b';
+        case S_IFIFO:  return 'p';
+        case S_IFSOCK: return 's';
+        default:       return '?';
+    }
+}
+
+static int number_width(unsigned long long value) {
+    int width = 1;
+    while (value >= 10) {
+        value /= 10;
+        width++;
+    }
+    return width;
+}
+
+static int is_device(mode_t mode) {
+    return S_ISCHR(mode) || S_ISBLK(mode);
+}
+
+/* Предварительный проход: ширины колонок по всему каталогу, как у ls */
+void prepare_row_format(RowFormat *fmt, const FileEntry *entries, int count) {
+    memset(fmt, 0, sizeof(*fmt));
+    fmt->now = time(NULL);
+    fmt->cached_minute = -1;
+
+    uid_t last_uid = 0;
+    gid_t last_gid = 0;
+    int owner_len = 0, group_len = 0;
+    for (int i = 0; i < count; i++) {
+        const FileEntry *e = &entries[i];
+        int w = number_width(e->nlink);
+        if (w > fmt->nlink_width) fmt->nlink_width = w;
+
+        if (i == 0 || e->uid != last_uid) {
+            owner_len = (int)strlen(cached_name(&user_cache, e->uid, 0));
+            last_uid = e->uid;
+        }
+        if (i == 0 || e->gid != last_gid) {
+            group_len = (int)strlen(cached_name(&group_cache, e->gid, 1));
+            last_gid = e->gid;
+        }
+        if (owner_len > fmt->owner_width) fmt->owner_width = owner_len;
+        if (group_len > fmt->group_width) fmt->group_width = group_len;
+
+        if (is_device(e->mode)) {
+            w = number_width(e->rdev_major);
+            if (w > fmt->major_width) fmt->major_width = w;
+            w = number_width(e->rdev_minor);
+            if (w > fmt->minor_width) fmt->minor_width = w;
+        } else {
+            w = number_width((unsigned long long)e->size);
+            if (w > fmt->size_width) fmt->size_width = w;
+        }
+    }
+    if (fmt->major_width > 0 && fmt->major_width + 2 + fmt->minor_width > fmt->size_width) {
+        fmt->size_width = fmt->major_width + 2 + fmt->minor_width;
+    }
+}
+
+/* Дата как у ls: время для свежих файлов, год для старых и будущих */
+static void put_date(OutBuf *out, RowFormat *fmt, time_t mtime) {
+    int recent = mtime > fmt->now - SIX_MONTHS && mtime <= fmt->now;
+    long minute = (long)(mtime >= 0 ? mtime / 60 : (mtime - 59) / 60);
+
+    if (minute != fmt->cached_minute || recent != fmt->cached_recent) {
+        struct tm tm;
+        localtime_r(&mtime, &tm);
+        fmt->cached_date_len = strftime(fmt->cached_date, sizeof(fmt->cached_date),
+                                        recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+        fmt->cached_minute = minute;
+        fmt->cached_recent = recent;
+    }
+    outbuf_put(out, fmt->cached_date, fmt->cached_date_len);
+}
+
+static void put_colored(OutBuf *out, const char *color, const char *name) {
+    if (color != NULL) outbuf_put(out, color, strlen(color));
+    outbuf_put(out, name, strlen(name));
+    if (color != NULL) outbuf_put(out, COLOR_RESET, sizeof(COLOR_RESET) - 1);
+}
+
+static const char *name_color(mode_t mode) {
+    if (S_ISDIR(mode)) return COLOR_BLUE;
+    if (S_ISLNK(mode)) return COLOR_CYAN;
+    if (mode & (S_IXUSR | S_IXGRP | S_IXOTH)) return COLOR_GREEN;
+    return NULL;
+}
+
+void print_short_format(OutBuf *out, const FileEntry *entry) {
+    put_colored(out, name_color(entry->mode), entry->name);
+    outbuf_put(out, "  ", 2);
+}
+
+void print_long_format(OutBuf *out, RowFormat *fmt, int dir_fd, const FileEntry *entry) {
+    const char *name = entry->name;
+    mode_t mode = entry->mode;
+    char *p = outbuf_reserve(out, 11);
+
+    p[0] = file_type_char(mode);
+    memcpy(p + 1, mode_table[mode & 07777], 9);
+    p[10] = ' ';
+    out->len += 11;
+
+    outbuf_number(out, (unsigned long long)entry->nlink, fmt->nlink_width);
+    outbuf_put(out, " ", 1);
+
+    const char *owner = cached_name(&user_cache, entry->uid, 0);
+    const char *group = cached_name(&group_cache, entry->gid, 1);
+    size_t owner_len = strlen(owner), group_len = strlen(group);
+    outbuf_put(out, owner, owner_len);
+    outbuf_pad(out, fmt->owner_width - (int)owner_len + 1);
+    outbuf_put(out, group, group_len);
+    outbuf_pad(out, fmt->group_width - (int)group_len + 1);
+
+    if (is_device(mode)) {
+        outbuf_pad(out, fmt->size_width - fmt->major_width - 2 - fmt->minor_width);
+        outbuf_number(out, entry->rdev_major, fmt->major_width);
+        outbuf_put(out, ", ", 2);
+        outbuf_number(out, entry->rdev_minor, fmt->minor_width);
+    } else {
+        outbuf_number(out, (unsigned long long)entry->size, fmt->size_width);
+    }
+    outbuf_put(out, " ", 1);
+
+    put_date(out, fmt, entry->mtime);
+    outbuf_put(out, " ", 1);
+
+    put_colored(out, name_color(mode), name);
+    if (S_ISLNK(mode)) {
+        char link_target[1024];
+        ssize_t len = readlinkat(dir_fd, name, link_target, sizeof(link_target));
+        if (len != -1) {
+            outbuf_put(out, " -> ", 4);
+            outbuf_put(out, link_target, (size_t)len);
+        }
+    }
+
+    outbuf_put(out, "\n", 1);
 }
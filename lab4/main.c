@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +7,88 @@
 #include <ctype.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#define MODE_OPS_MAX 64
+#define WALK_THREADS_MAX 16
+#define WALK_FDS_MAX 1024
+#define BATCH_CHUNK 64          /* fewer jobs per thread are not worth a thread */
+
+#define MODE_OP_MASK 0      /* mode = (mode & ~clear) | set */
+#define MODE_OP_IF_EXEC 1   /* 'X': cond bits join the change if any x bit is on */
+#define MODE_OP_COPY 2      /* 'u', 'g', 'o' on the right: copy that class */
+
+/* A parsed mode: each clause becomes "mode = (mode & ~clear) | set",
+ * so a file only costs a few AND/OR operations instead of a re-parse.
+ * Only X and u/g/o copies depend on the current mode; runs of plain
+ * masks are folded into one op at compile time. */
+struct mode_op {
+    mode_t clear;
+    mode_t set;
+    mode_t cond;            /* IF_EXEC: bits to add; COPY: class to copy */
+    mode_t limit;           /* COPY: bits the copied value may touch */
+    char kind;
+    char subtract;          /* conditional bits are cleared ('-') */
+};
+
+/* Directories get their own list: X always applies to them and they
+ * keep set-user/group-ID bits unless the mode mentions them. */
+struct mode_program {
+    struct mode_op ops[2][MODE_OPS_MAX];
+    int count[2];
+};
+
+struct walk_item {
+    char *path;
+    int fd;                 /* already opened directory or -1 */
+    struct walk_item *next;
+};
+
+struct walker {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct walk_item *head;
+    int pending;            /* queued plus in-progress directories */
+    int fds_open;
+    int fds_max;
+    int failed;
+    const struct mode_program *program;
+};
+
+/* One path of a command line or manifest batch */
+struct batch_job {
+    char *path;
+    const struct mode_program *program;
+    unsigned hash;          /* of the path: picks the worker */
+    int is_dir;
+};
+
+/* Jobs [begin, end) are split by path hash, so every job for one path
+ * runs on the same worker in batch order and the last one wins. */
+struct batch {
+    struct batch_job *jobs;
+    size_t count;
+    size_t capacity;
+    size_t begin;
+    size_t end;
+    size_t nthreads;
+    int probe;              /* only find out which jobs are directories */
+    int failed;
+};
+
+struct batch_worker {
+    struct batch *b;
+    size_t id;
+};
+
+/* Manifests repeat a handful of modes, each is compiled only once */
+struct manifest_mode {
+    char *text;
+    struct mode_program program;
+};
 
 void error_exit(const char *message) {
     perror(message);
@@ -13,13 +96,18 @@ void error_exit(const char *message) {
 }
 
 void print_usage(const char *prog_name) {
-    fprintf(stderr, "Usage: %s <mode> <file>\n", prog_name);
+    fprintf(stderr, "Usage: %s [-R] <mode> <file>...\n", prog_name);
+    fprintf(stderr, "       %s [-R] --reference=<rfile> <file>...\n", prog_name);
+    fprintf(stderr, "       %s [-R] --manifest <file>   (lines of \"<mode> <path>\", - for stdin)\n", prog_name);
     fprintf(stderr, "Examples:\n");
     fprintf(stderr, "  %s +x file.txt\n", prog_name);
     fprintf(stderr, "  %s u-r file.txt\n", prog_name);
     fprintf(stderr, "  %s ug+rw,o-r file.txt\n", prog_name);
     fprintf(stderr, "  %s a=rwx file.txt\n", prog_name);
+    fprintf(stderr, "  %s u=rwX,go=rX,+t dir\n", prog_name);
     fprintf(stderr, "  %s 755 file.txt\n", prog_name);
+    fprintf(stderr, "  %s -R go-w dir1 dir2\n", prog_name);
+    fprintf(stderr, "  %s --reference=a.txt b.txt c.txt\n", prog_name);
 }
 
 int handle_octal_mode(const char *mode_str, mode_t *new_mode) {
@@ -34,91 +122,144 @@ int handle_octal_mode(const char *mode_str, mode_t *new_mode) {
     return 0;
 }
 
-int handle_symbolic_mode(const char *mode_str, mode_t current_mode, mode_t *new_mode) {
+/* Add one "who op perms" change to both the file and directory lists,
+ * following the GNU chmod rules for umask and set-ID bits on directories. */
+static int program_add(struct mode_program *program, char op, int kind,
+                       mode_t affected, mode_t value, mode_t mentioned,
+                       mode_t umask_value) {
+    for (int dir = 0; dir < 2; dir++) {
+        mode_t omit = dir ? (S_ISUID | S_ISGID) & ~mentioned : 0;
+        /* Without who the umask limits the change */
+        mode_t limit = (affected ? affected : ~umask_value & 07777) & ~omit;
+        mode_t clear = 0, set = 0;
+
+        if (op == '=') {
+            /* '=' without who still clears the umasked bits */
+            clear = (affected ? affected : 07777) & ~omit;
+            set = value & limit;
+        } else if (op == '+') {
+            set = value & limit;
+        } else {
+            clear = value & limit;
+        }
+
+        mode_t cond = 0;
+        if (kind == MODE_OP_IF_EXEC) {
+            cond = (S_IXUSR | S_IXGRP | S_IXOTH) & limit;
+            if (dir) {
+                /* X always means x for directories */
+                if (op == '-') clear |= cond;
+                else set |= cond;
+                kind = MODE_OP_MASK;
+            }
+        } else if (kind == MODE_OP_COPY) {
+            cond = value;
+            set = 0;
+            if (op != '=') clear = 0;
+        }
+
+        struct mode_op *ops = program->ops[dir];
+        int n = program->count[dir];
+        if (kind == MODE_OP_MASK && n > 0 && ops[n - 1].kind == MODE_OP_MASK) {
+            /* (m & ~c1 | s1) & ~c2 | s2 == m & ~(c1 | c2) | (s1 & ~c2 | s2) */
+            ops[n - 1].set = (ops[n - 1].set & ~clear) | set;
+            ops[n - 1].clear |= clear;
+            continue;
+        }
+        if (n == MODE_OPS_MAX) {
+            fprintf(stderr, "Invalid symbolic mode: too many clauses\n");
+            return -1;
+        }
+        ops[n].clear = clear;
+        ops[n].set = set;
+        ops[n].cond = cond;
+        ops[n].limit = limit;
+        ops[n].kind = kind;
+        ops[n].subtract = op == '-';
+        program->count[dir] = n + 1;
+    }
+    return 0;
+}
+
+int compile_octal_mode(const char *mode_str, struct mode_program *program) {
+    mode_t new_mode;
+    if (handle_octal_mode(mode_str, &new_mode) != 0) {
+        return -1;
+    }
+    /* Like GNU chmod, fewer than five digits keep the set-ID bits of a
+     * directory unless they are given explicitly */
+    mode_t mentioned = 07777;
+    if (strlen(mode_str) < 5) {
+        mentioned = (new_mode & (S_ISUID | S_ISGID)) | S_ISVTX | S_IRWXU | S_IRWXG | S_IRWXO;
+    }
+    program->count[0] = program->count[1] = 0;
+    return program_add(program, '=', MODE_OP_MASK, 07777, new_mode, mentioned, 0);
+}
+
+int compile_symbolic_mode(const char *mode_str, struct mode_program *program) {
     if (mode_str == NULL || *mode_str == '\0') {
         fprintf(stderr, "Invalid symbolic mode: empty\n");
         return -1;
     }
 
-    mode_t result_mode = current_mode;
+    mode_t umask_value = umask(0);
+    umask(umask_value);
+
     const char *p = mode_str;
+    program->count[0] = program->count[1] = 0;
 
     while (*p) {
-        /* Parse who: [ugoa]* or empty (defaults to 'a') */
-        int affect_u = 0, affect_g = 0, affect_o = 0;
-        const char *who_start = p;
+        /* Parse who: [ugoa]*; empty means all classes filtered by the umask */
+        mode_t affected = 0;
         while (*p == 'u' || *p == 'g' || *p == 'o' || *p == 'a') {
-            if (*p == 'u') affect_u = 1;
-            else if (*p == 'g') affect_g = 1;
-            else if (*p == 'o') affect_o = 1;
-            else if (*p == 'a') affect_u = affect_g = affect_o = 1;
+            if (*p == 'u') affected |= S_ISUID | S_IRWXU;
+            else if (*p == 'g') affected |= S_ISGID | S_IRWXG;
+            else if (*p == 'o') affected |= S_ISVTX | S_IRWXO;
+            else if (*p == 'a') affected |= 07777;
             p++;
         }
-        if (p == who_start) {
-            /* no who specified -> default to 'a' */
-            affect_u = affect_g = affect_o = 1;
-        }
 
-        /* Parse op */
-        char op = *p;
-        if (op != '+' && op != '-' && op != '=') {
-            fprintf(stderr, "Invalid symbolic operator near: %s\n", p);
-            return -1;
-        }
-        p++;
-
-        /* Parse perms: [rwx]*; for '=' empty is allowed (clears all), for '+'/'-' empty is invalid */
-        int have_perm = 0;
-        int perm_r = 0, perm_w = 0, perm_x = 0;
-        while (*p == 'r' || *p == 'w' || *p == 'x') {
-            have_perm = 1;
-            if (*p == 'r') perm_r = 1;
-            else if (*p == 'w') perm_w = 1;
-            else if (*p == 'x') perm_x = 1;
+        /* One who may be followed by several ops, as in u+r-w */
+        do {
+            char op = *p;
+            if (op != '+' && op != '-' && op != '=') {
+                fprintf(stderr, "Invalid symbolic operator near: %s\n", p);
+                return -1;
+            }
             p++;
-        }
-        if ((op == '+' || op == '-') && !have_perm) {
-            fprintf(stderr, "Invalid symbolic mode: missing permissions after '%c'\n", op);
-            return -1;
-        }
 
-        /* Build bitmask per class */
-        mode_t mask_u = 0, mask_g = 0, mask_o = 0;
-        if (perm_r) {
-            if (affect_u) mask_u |= S_IRUSR;
-            if (affect_g) mask_g |= S_IRGRP;
-            if (affect_o) mask_o |= S_IROTH;
-        }
-        if (perm_w) {
-            if (affect_u) mask_u |= S_IWUSR;
-            if (affect_g) mask_g |= S_IWGRP;
-            if (affect_o) mask_o |= S_IWOTH;
-        }
-        if (perm_x) {
-            if (affect_u) mask_u |= S_IXUSR;
-            if (affect_g) mask_g |= S_IXGRP;
-            if (affect_o) mask_o |= S_IXOTH;
-        }
-
-        if (op == '+') {
-            result_mode |= mask_u | mask_g | mask_o;
-        } else if (op == '-') {
-            result_mode &= ~(mask_u | mask_g | mask_o);
-        } else if (op == '=') {
-            /* Clear r/w/x for affected classes, then set */
-            if (affect_u) {
-                result_mode &= ~(S_IRUSR | S_IWUSR | S_IXUSR);
-                result_mode |= mask_u;
+            /* Parse perms: [rwxXst]* or one of [ugo] to copy that class;
+             * for '=' empty is allowed (clears all), for '+'/'-' empty is invalid */
+            int have_perm = 0;
+            int kind = MODE_OP_MASK;
+            mode_t value = 0;
+            if (*p == 'u' || *p == 'g' || *p == 'o') {
+                have_perm = 1;
+                kind = MODE_OP_COPY;
+                value = *p == 'u' ? S_IRWXU : *p == 'g' ? S_IRWXG : S_IRWXO;
+                p++;
+            } else {
+                for (;; p++) {
+                    if (*p == 'r') value |= S_IRUSR | S_IRGRP | S_IROTH;
+                    else if (*p == 'w') value |= S_IWUSR | S_IWGRP | S_IWOTH;
+                    else if (*p == 'x') value |= S_IXUSR | S_IXGRP | S_IXOTH;
+                    else if (*p == 'X') kind = MODE_OP_IF_EXEC;
+                    else if (*p == 's') value |= S_ISUID | S_ISGID;
+                    else if (*p == 't') value |= S_ISVTX;
+                    else break;
+                    have_perm = 1;
+                }
             }
-            if (affect_g) {
-                result_mode &= ~(S_IRGRP | S_IWGRP | S_IXGRP);
-                result_mode |= mask_g;
+            if ((op == '+' || op == '-') && !have_perm) {
+                fprintf(stderr, "Invalid symbolic mode: missing permissions after '%c'\n", op);
+                return -1;
             }
-            if (affect_o) {
-                result_mode &= ~(S_IROTH | S_IWOTH | S_IXOTH);
-                result_mode |= mask_o;
+
+            mode_t mentioned = affected ? affected & value : value;
+            if (program_add(program, op, kind, affected, value, mentioned, umask_value) != 0) {
+                return -1;
             }
-        }
+        } while (*p == '+' || *p == '-' || *p == '=');
 
         /* Next clause separated by comma */
         if (*p == ',') {
@@ -133,48 +274,599 @@ int handle_symbolic_mode(const char *mode_str, mode_t current_mode, mode_t *new_
         }
     }
 
-    *new_mode = result_mode;
     return 0;
 }
 
+int compile_mode(const char *mode_str, struct mode_program *program) {
+    int is_octal = *mode_str != '\0';
+    for (const char *p = mode_str; *p; ++p) {
+        if (!isdigit((unsigned char)*p)) {
+            is_octal = 0;
+            break;
+        }
+    }
+    if (is_octal) {
+        return compile_octal_mode(mode_str, program);
+    }
+    return compile_symbolic_mode(mode_str, program);
+}
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        print_usage(argv[0]);
-        return EXIT_FAILURE;
+mode_t apply_mode(const struct mode_program *program, mode_t current_mode) {
+    int dir = S_ISDIR(current_mode) ? 1 : 0;
+    const struct mode_op *op = program->ops[dir];
+    mode_t mode = current_mode & 07777;
+
+    for (int i = 0; i < program->count[dir]; i++, op++) {
+        mode_t clear = op->clear, set = op->set;
+        if (op->kind != MODE_OP_MASK) {
+            mode_t bits;
+            if (op->kind == MODE_OP_IF_EXEC) {
+                bits = (mode & (S_IXUSR | S_IXGRP | S_IXOTH)) ? op->cond : 0;
+            } else {
+                /* Spread the copied class over all three, then limit it */
+                mode_t from = mode & op->cond;
+                bits = ((from & (S_IRUSR | S_IRGRP | S_IROTH)) ? S_IRUSR | S_IRGRP | S_IROTH : 0)
+                     | ((from & (S_IWUSR | S_IWGRP | S_IWOTH)) ? S_IWUSR | S_IWGRP | S_IWOTH : 0)
+                     | ((from & (S_IXUSR | S_IXGRP | S_IXOTH)) ? S_IXUSR | S_IXGRP | S_IXOTH : 0);
+                bits &= op->limit;
+            }
+            if (op->subtract) clear |= bits;
+            else set |= bits;
+        }
+        mode = (mode & ~clear) | set;
+    }
+    return mode;
+}
+
+static void report_error(const char *action, const char *dir, const char *name) {
+    int saved_errno = errno;
+    if (name == NULL) {
+        fprintf(stderr, "%s: %s: %s\n", action, dir, strerror(saved_errno));
+    } else {
+        fprintf(stderr, "%s: %s/%s: %s\n", action, dir, name, strerror(saved_errno));
+    }
+}
+
+/* Change one entry of an open directory; the stat is needed anyway to
+ * compute the new mode, and lets us skip chmod when nothing changes. */
+static int change_entry(int dir_fd, const char *dir, const char *name,
+                        const struct mode_program *program, struct stat *st) {
+    if (fstatat(dir_fd, name, st, AT_SYMLINK_NOFOLLOW) != 0) {
+        report_error("Failed to get file info", dir, name);
+        return -1;
+    }
+    /* Symlinks met during the walk are neither changed nor followed */
+    if (S_ISLNK(st->st_mode)) {
+        return 0;
+    }
+    mode_t new_mode = apply_mode(program, st->st_mode);
+    if (new_mode == (st->st_mode & 07777)) {
+        return 0;
+    }
+    if (fchmodat(dir_fd, name, new_mode, 0) != 0) {
+        report_error("Failed to change file mode", dir, name);
+        return -1;
+    }
+    st->st_mode = (st->st_mode & ~07777) | new_mode;
+    return 0;
+}
+
+static void walker_push(struct walker *w, char *path, int fd) {
+    struct walk_item *item = malloc(sizeof(*item));
+    if (item == NULL) {
+        error_exit("malloc");
+    }
+    item->path = path;
+    item->fd = fd;
+
+    pthread_mutex_lock(&w->lock);
+    /* LIFO keeps the walk depth-first and the queue short */
+    item->next = w->head;
+    w->head = item;
+    w->pending++;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static int walker_reserve_fd(struct walker *w) {
+    int ok;
+    pthread_mutex_lock(&w->lock);
+    ok = w->fds_open < w->fds_max;
+    if (ok) {
+        w->fds_open++;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+static void walker_release_fd(struct walker *w) {
+    pthread_mutex_lock(&w->lock);
+    w->fds_open--;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void walker_fail(struct walker *w) {
+    pthread_mutex_lock(&w->lock);
+    w->failed = 1;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void walk_directory(struct walker *w, struct walk_item *item) {
+    int fd = item->fd;
+    if (fd < 0) {
+        /* Queued without a descriptor because the budget ran out; open it
+         * anyway, this overshoots the budget by at most one per thread */
+        pthread_mutex_lock(&w->lock);
+        w->fds_open++;
+        pthread_mutex_unlock(&w->lock);
+        fd = open(item->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            report_error("Failed to open directory", item->path, NULL);
+            walker_release_fd(w);
+            walker_fail(w);
+            return;
+        }
     }
 
-    const char *mode_str = argv[1];
-    const char *file_path = argv[2];
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        report_error("Failed to open directory", item->path, NULL);
+        close(fd);
+        walker_release_fd(w);
+        walker_fail(w);
+        return;
+    }
+
+    struct dirent *entry;
+    struct stat st;
+    errno = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        if (change_entry(fd, item->path, name, w->program, &st) != 0) {
+            walker_fail(w);
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            continue;
+        }
+
+        /* The directory mode is already updated, so a newly granted
+         * search permission takes effect before descending (like GNU). */
+        size_t dir_len = strlen(item->path);
+        size_t name_len = strlen(name);
+        char *child = malloc(dir_len + name_len + 2);
+        if (child == NULL) {
+            error_exit("malloc");
+        }
+        memcpy(child, item->path, dir_len);
+        child[dir_len] = '/';
+        memcpy(child + dir_len + 1, name, name_len + 1);
+
+        int child_fd = -1;
+        if (walker_reserve_fd(w)) {
+            child_fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child_fd < 0) {
+                report_error("Failed to open directory", item->path, name);
+                walker_release_fd(w);
+                walker_fail(w);
+                free(child);
+                continue;
+            }
+        }
+        walker_push(w, child, child_fd);
+    }
+    if (errno != 0) {
+        report_error("Failed to read directory", item->path, NULL);
+        walker_fail(w);
+    }
+
+    closedir(dir);
+    walker_release_fd(w);
+}
+
+static void *walker_thread(void *arg) {
+    struct walker *w = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        while (w->head == NULL && w->pending > 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        struct walk_item *item = w->head;
+        if (item == NULL) {
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        w->head = item->next;
+        pthread_mutex_unlock(&w->lock);
+
+        walk_directory(w, item);
+        free(item->path);
+        free(item);
+
+        pthread_mutex_lock(&w->lock);
+        if (--w->pending == 0) {
+            pthread_cond_broadcast(&w->cond);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    return NULL;
+}
 
+/* Recursively change everything below an already changed directory. */
+int change_tree(const char *path, const struct mode_program *program) {
+    struct walker w;
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    w.head = NULL;
+    w.pending = 0;
+    w.fds_open = 0;
+    w.failed = 0;
+    w.program = program;
+
+    /* Leave room for stdio and the other threads under RLIMIT_NOFILE */
+    struct rlimit limit;
+    w.fds_max = WALK_FDS_MAX;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY
+        && (rlim_t)w.fds_max > limit.rlim_cur / 2) {
+        w.fds_max = limit.rlim_cur / 2;
+    }
+    if (w.fds_max < 1) {
+        w.fds_max = 1;
+    }
+
+    /* The root was given by the user and is followed like chmod(2) does;
+     * O_NOFOLLOW applies only to what the walk finds below it */
+    int root_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        report_error("Failed to open directory", path, NULL);
+        pthread_cond_destroy(&w.cond);
+        pthread_mutex_destroy(&w.lock);
+        return -1;
+    }
+    char *root = strdup(path);
+    if (root == NULL) {
+        error_exit("strdup");
+    }
+    w.fds_open = 1;
+    walker_push(&w, root, root_fd);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cpus > 0 ? (int)cpus : 1;
+    if (nthreads > WALK_THREADS_MAX) {
+        nthreads = WALK_THREADS_MAX;
+    }
+
+    pthread_t threads[WALK_THREADS_MAX];
+    int started = 0;
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, walker_thread, &w) != 0) {
+            break;
+        }
+        started++;
+    }
+    walker_thread(&w);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+    return w.failed ? -1 : 0;
+}
+
+/* Change a command line or manifest path, which is followed like chmod(2)
+ * does; is_dir is set as soon as the path is known to be a directory. */
+int change_file(const char *path, const struct mode_program *program, int *is_dir) {
     struct stat file_stat;
-    if (stat(file_path, &file_stat) != 0) {
-        error_exit("Failed to get file info");
+    *is_dir = 0;
+    if (stat(path, &file_stat) != 0) {
+        report_error("Failed to get file info", path, NULL);
+        return -1;
     }
+    *is_dir = S_ISDIR(file_stat.st_mode);
 
-    mode_t new_mode;
-    int is_octal = 1;
-    for (const char *p = mode_str; *p; ++p) {
-        if (!isdigit(*p)) {
-            is_octal = 0;
+    mode_t new_mode = apply_mode(program, file_stat.st_mode);
+    if (new_mode != (file_stat.st_mode & 07777) && chmod(path, new_mode) != 0) {
+        report_error("Failed to change file mode", path, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+static void batch_add(struct batch *b, char *path, const struct mode_program *program) {
+    if (b->count == b->capacity) {
+        b->capacity = b->capacity ? b->capacity * 2 : 64;
+        b->jobs = realloc(b->jobs, b->capacity * sizeof(*b->jobs));
+        if (b->jobs == NULL) {
+            error_exit("realloc");
+        }
+    }
+    /* FNV-1a */
+    unsigned hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    b->jobs[b->count].path = path;
+    b->jobs[b->count].program = program;
+    b->jobs[b->count].hash = hash;
+    b->jobs[b->count].is_dir = 0;
+    b->count++;
+}
+
+static void *batch_thread(void *arg) {
+    struct batch_worker *worker = arg;
+    struct batch *b = worker->b;
+
+    for (size_t i = b->begin; i < b->end; i++) {
+        struct batch_job *job = &b->jobs[i];
+        if (job->hash % b->nthreads != worker->id) {
+            continue;
+        }
+        if (b->probe) {
+            struct stat file_stat;
+            job->is_dir = stat(job->path, &file_stat) == 0 && S_ISDIR(file_stat.st_mode);
+        } else if (change_file(job->path, job->program, &job->is_dir) != 0) {
+            __atomic_store_n(&b->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/* Run jobs [begin, end) on a thread pool sized by their number */
+static void run_jobs(struct batch *b, size_t begin, size_t end, int probe) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = cpus > 0 ? (size_t)cpus : 1;
+    if (nthreads > WALK_THREADS_MAX) {
+        nthreads = WALK_THREADS_MAX;
+    }
+    if (nthreads > (end - begin + BATCH_CHUNK - 1) / BATCH_CHUNK) {
+        nthreads = (end - begin + BATCH_CHUNK - 1) / BATCH_CHUNK;
+    }
+    if (nthreads == 0) {
+        nthreads = 1;
+    }
+
+    b->begin = begin;
+    b->end = end;
+    b->nthreads = nthreads;
+    b->probe = probe;
+    pthread_t threads[WALK_THREADS_MAX];
+    struct batch_worker workers[WALK_THREADS_MAX];
+    size_t started = 0;
+    for (size_t i = 0; i < nthreads; i++) {
+        workers[i].b = b;
+        workers[i].id = i;
+    }
+    for (size_t i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, batch_thread, &workers[i]) != 0) {
             break;
         }
+        started++;
     }
-    
-    int result;
-    if (is_octal) {
-        result = handle_octal_mode(mode_str, &new_mode);
-    } else {
-        result = handle_symbolic_mode(mode_str, file_stat.st_mode, &new_mode);
+    batch_thread(&workers[0]);
+    /* Shares the pool would have run */
+    for (size_t i = started + 1; i < nthreads; i++) {
+        batch_thread(&workers[i]);
+    }
+    for (size_t i = 1; i <= started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Apply the batch as if line by line. Without -R that is one parallel
+ * run. With -R a directory's walk has to happen at its own position:
+ * it overrides earlier jobs below it and later jobs override it, so the
+ * batch is cut after every directory and the walks run in between. */
+int run_batch(struct batch *b, int recursive) {
+    b->failed = 0;
+    if (!recursive) {
+        run_jobs(b, 0, b->count, 0);
+        return b->failed ? -1 : 0;
+    }
+
+    run_jobs(b, 0, b->count, 1);
+    int failed = 0;
+    size_t begin = 0;
+    while (begin < b->count) {
+        size_t end = begin;
+        while (end < b->count && !b->jobs[end].is_dir) {
+            end++;
+        }
+        if (end < b->count) {
+            end++;
+        }
+        run_jobs(b, begin, end, 0);
+
+        struct batch_job *last = &b->jobs[end - 1];
+        if (last->is_dir && change_tree(last->path, last->program) != 0) {
+            failed = 1;
+        }
+        begin = end;
     }
-    
-    if (result != 0) {
+    return failed || b->failed ? -1 : 0;
+}
+
+/* --reference: the exact mode bits of RFILE, set-ID bits included */
+int compile_reference(const char *ref_path, struct mode_program *program) {
+    struct stat ref_stat;
+    if (stat(ref_path, &ref_stat) != 0) {
+        report_error("Failed to get file info", ref_path, NULL);
+        return -1;
+    }
+    program->count[0] = program->count[1] = 0;
+    return program_add(program, '=', MODE_OP_MASK, 07777, ref_stat.st_mode & 07777, 07777, 0);
+}
+
+static const struct mode_program *manifest_program(struct manifest_mode ***modes, size_t *count,
+                                                   const char *text) {
+    for (size_t i = *count; i > 0; i--) {
+        if (strcmp((*modes)[i - 1]->text, text) == 0) {
+            return &(*modes)[i - 1]->program;
+        }
+    }
+
+    struct manifest_mode *mode = malloc(sizeof(*mode));
+    if (mode == NULL) {
+        error_exit("malloc");
+    }
+    if (compile_mode(text, &mode->program) != 0) {
+        free(mode);
+        return NULL;
+    }
+    mode->text = strdup(text);
+    *modes = realloc(*modes, (*count + 1) * sizeof(**modes));
+    if (mode->text == NULL || *modes == NULL) {
+        error_exit("malloc");
+    }
+    (*modes)[(*count)++] = mode;
+    return &mode->program;
+}
+
+/* --manifest: one "mode path" pair per line, "-" reads standard input.
+ * Empty lines and lines starting with '#' are skipped; a bad line is
+ * reported and the rest of the manifest is still applied. */
+int run_manifest(const char *manifest_path, int recursive) {
+    FILE *manifest = stdin;
+    if (strcmp(manifest_path, "-") != 0) {
+        manifest = fopen(manifest_path, "r");
+        if (manifest == NULL) {
+            report_error("Failed to open manifest", manifest_path, NULL);
+            return -1;
+        }
+    }
+
+    struct batch b = {0};
+    struct manifest_mode **modes = NULL;
+    size_t nmodes = 0;
+    int failed = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    size_t line_no = 0;
+
+    while ((len = getline(&line, &line_size, manifest)) != -1) {
+        line_no++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        /* The path is everything after the blanks following the mode */
+        char *path = line;
+        while (*path && *path != ' ' && *path != '\t') {
+            path++;
+        }
+        if (*path) {
+            *path++ = '\0';
+        }
+        while (*path == ' ' || *path == '\t') {
+            path++;
+        }
+        if (*path == '\0') {
+            fprintf(stderr, "%s:%zu: missing path\n", manifest_path, line_no);
+            failed = 1;
+            continue;
+        }
+
+        const struct mode_program *program = manifest_program(&modes, &nmodes, line);
+        if (program == NULL) {
+            fprintf(stderr, "%s:%zu: invalid mode\n", manifest_path, line_no);
+            failed = 1;
+            continue;
+        }
+        char *copy = strdup(path);
+        if (copy == NULL) {
+            error_exit("strdup");
+        }
+        batch_add(&b, copy, program);
+    }
+    if (ferror(manifest)) {
+        report_error("Failed to read manifest", manifest_path, NULL);
+        failed = 1;
+    }
+    if (manifest != stdin) {
+        fclose(manifest);
+    }
+    free(line);
+
+    if (run_batch(&b, recursive) != 0) {
+        failed = 1;
+    }
+
+    for (size_t i = 0; i < b.count; i++) {
+        free(b.jobs[i].path);
+    }
+    free(b.jobs);
+    for (size_t i = 0; i < nmodes; i++) {
+        free(modes[i]->text);
+        free(modes[i]);
+    }
+    free(modes);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    int recursive = 0;
+    const char *reference = NULL;
+    const char *manifest = NULL;
+    int argi = 1;
+
+    /* Parsed by hand: modes such as "-w" look like options to getopt */
+    while (argi < argc) {
+        const char *arg = argv[argi];
+        if (strcmp(arg, "-R") == 0 || strcmp(arg, "--recursive") == 0) {
+            recursive = 1;
+        } else if (strncmp(arg, "--reference=", 12) == 0) {
+            reference = arg + 12;
+        } else if (strncmp(arg, "--manifest=", 11) == 0) {
+            manifest = arg + 11;
+        } else if ((strcmp(arg, "--reference") == 0 || strcmp(arg, "--manifest") == 0) && argi + 1 < argc) {
+            if (arg[2] == 'r') reference = argv[argi + 1];
+            else manifest = argv[argi + 1];
+            argi++;
+        } else {
+            break;
+        }
+        argi++;
+    }
+    if (argi < argc && strcmp(argv[argi], "--") == 0) {
+        argi++;
+    }
+
+    if (manifest != NULL) {
+        if (reference != NULL || argi != argc) {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        return run_manifest(manifest, recursive) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (argc - argi < (reference != NULL ? 1 : 2)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct mode_program program;
+    if (reference != NULL) {
+        if (compile_reference(reference, &program) != 0) {
+            return EXIT_FAILURE;
+        }
+    } else if (compile_mode(argv[argi++], &program) != 0) {
         return EXIT_FAILURE;
     }
 
-    if (chmod(file_path, new_mode) != 0) {
-        error_exit("Failed to change file mode");
+    struct batch b = {0};
+    for (; argi < argc; argi++) {
+        batch_add(&b, argv[argi], &program);
     }
+    int status = run_batch(&b, recursive) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    free(b.jobs);
 
-    return EXIT_SUCCESS;
+    return status;
 }
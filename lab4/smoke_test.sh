@@ -0,0 +1,132 @@
+#!/bin/sh
+# Smoke test for mychmod: --manifest lines apply in order, -R follows a
+# command-line symlink, and the compiled mode program matches GNU chmod
+# for every start mode.
+# Usage: ./smoke_test.sh [path/to/mychmod]
+
+BIN=$(cd "$(dirname "${1:-./mychmod}")" && pwd)/$(basename "${1:-./mychmod}")
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+cd "$TMP" || exit 1
+status=0
+
+check() {
+    actual=$(stat -c '%a' "$1")
+    if [ "$actual" != "$2" ]; then
+        echo "FAIL: $3: $1 is $actual, expected $2"
+        status=1
+    fi
+}
+
+# Filler lines on other files, so the batch is big enough for several workers
+filler() {
+    i=0
+    while [ $i -lt 300 ]; do
+        echo "600 fill$i"
+        i=$((i + 1))
+    done
+}
+i=0
+while [ $i -lt 300 ]; do : > "fill$i"; i=$((i + 1)); done
+
+mkdir -p d/sub
+: > d/f
+: > d/sub/g
+: > x
+
+# A later line for a nested path wins over an earlier recursive one
+printf '700 d\n644 d/f\n' > m1
+"$BIN" -R --manifest m1 || status=1
+check d 700 "recursive then nested"
+check d/sub/g 700 "recursive then nested"
+check d/f 644 "recursive then nested"
+
+# ...and a later recursive line wins over an earlier nested one
+printf '600 d/f\n750 d\n' > m2
+"$BIN" -R --manifest m2 || status=1
+check d/f 750 "nested then recursive"
+check d/sub 750 "nested then recursive"
+
+# Duplicate paths with relative modes compose in line order
+{ echo "600 x"; filler; echo "u+x x"; filler; echo "g+r x"; filler; echo "o=w x"; } > m3
+"$BIN" --manifest m3 || status=1
+check x 742 "duplicates"
+check fill0 600 "duplicates"
+
+# Standard input and the last line for a path winning
+printf '644 x\n# comment\n\n600 x\n' | "$BIN" --manifest - || status=1
+check x 600 "stdin"
+
+# A bad line is reported, the rest is still applied, the exit status is 1
+printf 'bogus x\n640 x\n' > m4
+"$BIN" --manifest m4 2> /dev/null && { echo "FAIL: bad line: exit status 0"; status=1; }
+check x 640 "bad line"
+
+# -R follows a symlink given on the command line, but not one met below it
+mkdir -p real/sub outside
+: > real/f
+: > real/sub/g
+: > outside/h
+chmod 644 outside/h
+ln -s real link
+ln -s ../outside real/out
+"$BIN" -R 700 link || { echo "FAIL: -R on a symlink: exit status"; status=1; }
+check real 700 "-R on a symlink"
+check real/sub/g 700 "-R on a symlink"
+check outside/h 644 "-R on a symlink"
+printf '750 link\n' > m5
+"$BIN" -R --manifest m5 || { echo "FAIL: -R --manifest on a symlink: exit status"; status=1; }
+check real/f 750 "-R --manifest on a symlink"
+check outside/h 644 "-R --manifest on a symlink"
+
+# Property test against GNU chmod as the oracle: every mode string is
+# applied to all 4096 start modes, as files and as directories, under two
+# umasks. Start modes are set with one manifest and checked with stat.
+MODES='0 644 755 7777 1755 2755 4755 00755 02755 u+x g-w o= a+X +X
+u=rwx,g=rx,o= go-rwx u+s g+s +t o+t a-st u=g g=u o=u ug=o u+r-w
+g+w-x+X =r +w -x a= u=rw,g+X,o-r =,u+s a+rwx,g-s u-s,g-s =X +s o=g-w'
+
+if chmod --version 2> /dev/null | grep -q GNU; then
+    mkdir oracle mine
+    : > start
+    : > want.start
+    i=0
+    while [ $i -lt 4096 ]; do
+        m=$(printf '%04o' $i)
+        for dir in oracle mine; do
+            : > "$dir/f$m"
+            mkdir "$dir/d$m"
+            printf '0%s %s/d%s\n0%s %s/f%s\n' $m $dir $m $m $dir $m >> start
+        done
+        i=$((i + 1))
+    done
+    for f in oracle/* mine/*; do
+        m=${f#*/?}
+        printf '%s %o\n' "$f" "0$m" >> want.start
+    done
+    for mask in 022 077; do
+        for mode in $MODES; do
+            "$BIN" --manifest start || { echo "FAIL: oracle: setting start modes"; status=1; break 2; }
+            stat -c '%n %a' oracle/* mine/* > got.start
+            if ! cmp -s want.start got.start; then
+                echo "FAIL: oracle: start modes were not set"
+                status=1
+                break 2
+            fi
+            (umask $mask && cd oracle && chmod -- "$mode" * 2> /dev/null)
+            (umask $mask && cd mine && "$BIN" "$mode" * 2> /dev/null)
+            (cd oracle && stat -c '%n %a' -- *) > want
+            (cd mine && stat -c '%n %a' -- *) > got
+            if ! cmp -s want got; then
+                echo "FAIL: oracle: '$mode' under umask $mask differs from GNU chmod:"
+                diff want got | head -5
+                status=1
+            fi
+        done
+    done
+else
+    echo "skip: GNU chmod not found, oracle comparison not run"
+fi
+
+[ $status -eq 0 ] && echo "mychmod: OK"
+exit $status
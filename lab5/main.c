@@ -1,367 +1,1860 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <time.h>
 #include <utime.h>
 #include <getopt.h>
 #include <errno.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <pthread.h>
 
 struct file_header {
     char name[256];
     struct stat metadata;
     char is_deleted;
+    unsigned char flags;    /* ENTRY_*; занимает бывшее выравнивание, размер прежний */
+    unsigned char codec;    /* CODEC_*; тоже из выравнивания */
 };
 
+#define ENTRY_HARDLINK 1    /* данные - имя предыдущей записи с тем же inode */
+#define ENTRY_SPARSE 2      /* данные - карта экстентов и сами экстенты */
+
+#define CODEC_NONE 0        /* данные хранятся как есть */
+#define CODEC_LZ 1          /* блоки сжаты встроенным LZ */
+
 #define MAX_FILE_SIZE (1024LL * 1024LL * 1024LL)
 
+#define COPY_CHUNK (1 << 30)            /* за один copy_file_range/sendfile */
+#define COPY_BUFFER_SIZE (1024 * 1024)  /* буфер запасного pread/pwrite */
+
+#define COMPACT_THRESHOLD 50     /* % удалённых данных, после которого -e сжимает архив */
+
+#define CODEC_BLOCK (256 * 1024)        /* блок сжатия */
+#define CODEC_GROUP_BLOCKS 16           /* блоков сжимается параллельно за раз */
+#define CODEC_STORED_BIT 0x80000000u    /* кадр содержит блок без сжатия */
+#define CODEC_MIN_SAVING 10             /* %; если сжатие экономит меньше, запись хранится как есть */
+
+#define INPUT_THREADS_MAX 8
+#define INPUT_SMALL_MAX (1024 * 1024)       /* файлы меньше читаются воркерами в память */
+#define INPUT_BUDGET (64 * 1024 * 1024)     /* прочитано, но ещё не записано */
+#define INPUT_AHEAD_MAX 256                 /* открытых входных файлов впереди писателя */
+
+/* Формат с оглавлением:
+   [заголовок_1][данные_1]...[заголовок_N][данные_N][записи оглавления][имена][footer]
+   Старые архивы без footer читаются последовательным проходом по заголовкам. */
+#define ARCHIVE_MAGIC "ARCHIDX1"
+#define ARCHIVE_VERSION 3
+
+#define INDEX_DELETED 1
+#define INDEX_HARDLINK 2
+#define INDEX_SPARSE 4
+#define INDEX_CODEC_SHIFT 8     /* с версии 3 биты 8-15 - кодек данных */
+#define INDEX_CODEC(flags) (((flags) >> INDEX_CODEC_SHIFT) & 0xff)
+
+struct index_entry {
+    uint64_t name_hash;
+    uint64_t offset;        /* смещение file_header в архиве */
+    uint64_t size;          /* размер данных в архиве */
+    uint64_t file_size;     /* размер самого файла */
+    int64_t mtime;
+    uint32_t name_offset;   /* смещение имени в таблице имён */
+    uint32_t flags;
+};
+
+/* Запись оглавления версии 1: размер данных всегда равен размеру файла */
+struct index_entry_v1 {
+    uint64_t name_hash;
+    uint64_t offset;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t name_offset;
+    uint32_t flags;
+};
+
+/* Разреженный файл хранится как [число экстентов][экстенты][данные экстентов] */
+struct sparse_extent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct archive_footer {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t entry_count;
+    uint64_t index_offset;  /* начало оглавления = конец данных */
+    uint64_t names_size;
+};
+
+/* Журнал компактации. Пока он лежит последним в файле, компактация не
+   закончена: перед ним записан образ архива начиная с dst (сдвинутые данные,
+   оглавление, footer) длиной len. Зафиксированный образ копируется на dst,
+   и файл обрезается; незафиксированный отбрасывается обрезкой до old_size. */
+#define JOURNAL_MAGIC "ARCHJRN1"
+#define JOURNAL_STAGING 0
+#define JOURNAL_COMMITTED 1
+
+struct compact_journal {
+    char magic[8];
+    uint32_t version;
+    uint32_t state;         /* JOURNAL_* */
+    uint64_t old_size;      /* размер архива до компактации */
+    uint64_t dst;           /* первый байт, который меняет компактация */
+    uint64_t len;           /* длина образа */
+};
+
+/* Открытый архив: оглавление целиком в памяти */
+struct archive {
+    int fd;
+    uint32_t version;       /* 0 - старый формат без оглавления */
+    struct index_entry *entries;
+    size_t count;
+    size_t capacity;
+    char *names;
+    size_t names_size;
+    size_t names_capacity;
+    off_t data_end;
+    /* Поиск по имени: открытая адресация по name_hash, строится при первом
+       поиске. Слот - новейшая запись с этим именем, prev - предыдущая с
+       тем же; номер + 1, 0 - нет. Внесены записи [0, indexed). */
+    uint32_t *slots;
+    size_t slot_mask;
+    uint32_t *prev;
+    size_t indexed;
+};
+
 void print_help() {
-    printf("Использование: ./archiver arch_name [ключ] [файл]\n");
+    printf("Использование: ./archiver arch_name [ключ] [файл...]\n");
     printf("Ключи:\n");
-    printf("  -i, --input <file>    Добавить файл в архив\n");
+    printf("  -i, --input <file>... Добавить файлы в архив (каталоги - рекурсивно)\n");
+    printf("  -z, --compress <codec> Сжимать добавляемые файлы: lz или none (по умолчанию)\n");
     printf("  -e, --extract <file>  Извлечь файл из архива (с удалением из него)\n");
     printf("  -s, --stat            Показать содержимое архива\n");
+    printf("  -c, --compact         Освободить место извлечённых файлов\n");
+    printf("  -t, --threshold <%%>   Сжимать архив после -e, когда удалённые данные\n");
+    printf("                        занимают не меньше <%%> архива (по умолчанию %d)\n", COMPACT_THRESHOLD);
     printf("  -h, --help            Показать эту справку\n");
 }
 
-/* Сжимает архив: копирует только ненужные (is_deleted == 0) записи
-   в временный файл и переименовывает его в исходный */
-int compact_archive(const char *archive_name) {
-    int in_fd = open(archive_name, O_RDONLY);
-    if (in_fd == -1) {
-        perror("compact: не удалось открыть архив для чтения");
-        return -1;
+/* FNV-1a */
+uint64_t hash_name(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
     }
+    return hash;
+}
 
-    /* temp template: "<archive_name>.tmpXXXXXX" */
-    size_t tlen = strlen(archive_name) + 12;
-    char *tmp_name = malloc(tlen);
-    if (!tmp_name) { close(in_fd); return -1; }
-    snprintf(tmp_name, tlen, "%s.tmpXXXXXX", archive_name);
-
-    int tmp_fd = mkstemp(tmp_name);
-    if (tmp_fd == -1) {
-        perror("compact: не удалось создать временный файл");
-        free(tmp_name);
-        close(in_fd);
-        return -1;
+/* pwrite до конца буфера */
+int write_all(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t w = pwrite(fd, p, len, offset);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        len -= w;
+        offset += w;
     }
+    return 0;
+}
+
+/* Если ядро или ФС не умеют ускоренный способ, пробуем следующий */
+static int copy_unsupported(int err) {
+    return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP
+        || err == ENOTSUP || err == EBADF || err == ESPIPE;
+}
 
-    /* попытаться применить права исходного файла к временному */
-    struct stat arch_st;
-    if (fstat(in_fd, &arch_st) == 0) {
-        fchmod(tmp_fd, arch_st.st_mode);
+/* Копирует до len байт между дескрипторами по явным смещениям.
+   Порядок: copy_file_range (без копирования через пространство
+   пользователя, на btrfs/xfs - reflink), затем sendfile, затем
+   pread/pwrite большим буфером.
+   Возвращает число скопированных байт (меньше len при EOF) или -1. */
+off_t copy_data(int in_fd, off_t in_off, int out_fd, off_t out_off, off_t len) {
+    off_t done = 0;
+
+    while (done < len) {
+        loff_t src = in_off + done, dst = out_off + done;
+        size_t chunk = (len - done > COPY_CHUNK) ? COPY_CHUNK : (size_t)(len - done);
+        ssize_t n = copy_file_range(in_fd, &src, out_fd, &dst, chunk, 0);
+        if (n > 0) {
+            done += n;
+            continue;
+        }
+        if (n == 0) return done;
+        if (errno == EINTR) continue;
+        if (!copy_unsupported(errno)) return -1;
+        break;
     }
 
-    struct file_header header;
-    ssize_t r;
-    char buf[4096];
-
-    while ((r = read(in_fd, &header, sizeof(header))) == sizeof(header)) {
-        off_t remaining = header.metadata.st_size;
-
-        if (!header.is_deleted) {
-            /* Переписать заголовок */
-            if (write(tmp_fd, &header, sizeof(header)) != sizeof(header)) {
-                perror("compact: ошибка записи заголовка во временный файл");
-                close(in_fd);
-                close(tmp_fd);
-                unlink(tmp_name);
-                free(tmp_name);
-                return -1;
+    /* sendfile пишет с текущей позиции выходного файла */
+    if (done < len && lseek(out_fd, out_off + done, SEEK_SET) != -1) {
+        while (done < len) {
+            off_t src = in_off + done;
+            size_t chunk = (len - done > COPY_CHUNK) ? COPY_CHUNK : (size_t)(len - done);
+            ssize_t n = sendfile(out_fd, in_fd, &src, chunk);
+            if (n > 0) {
+                done += n;
+                continue;
             }
+            if (n == 0) return done;
+            if (errno == EINTR) continue;
+            if (!copy_unsupported(errno)) return -1;
+            break;
+        }
+    }
 
-            /* Копировать данные порциями */
-            while (remaining > 0) {
-                ssize_t to_read = (remaining > (off_t)sizeof(buf)) ? sizeof(buf) : (ssize_t)remaining;
-                ssize_t br = read(in_fd, buf, to_read);
-                if (br <= 0) {
-                    if (br == -1) perror("compact: ошибка чтения данных из архива");
-                    else fprintf(stderr, "compact: неожиданное EOF при чтении данных\n");
-                    close(in_fd);
-                    close(tmp_fd);
-                    unlink(tmp_name);
-                    free(tmp_name);
-                    return -1;
-                }
-                ssize_t bw = write(tmp_fd, buf, br);
-                if (bw != br) {
-                    perror("compact: ошибка записи данных во временный файл");
-                    close(in_fd);
-                    close(tmp_fd);
-                    unlink(tmp_name);
-                    free(tmp_name);
-                    return -1;
-                }
-                remaining -= br;
-            }
-        } else {
-            /* Пропустить данные удалённой записи (lseek быстрее, если поддерживается) */
-            if (lseek(in_fd, header.metadata.st_size, SEEK_CUR) == -1) {
-                /* на случай, если lseek не сработал, прочитаем и пропустим вручную */
-                off_t skip = header.metadata.st_size;
-                while (skip > 0) {
-                    ssize_t to_read = (skip > (off_t)sizeof(buf)) ? sizeof(buf) : (ssize_t)skip;
-                    ssize_t br = read(in_fd, buf, to_read);
-                    if (br <= 0) break;
-                    skip -= br;
-                }
-            }
+    if (done == len) return done;
+
+    size_t buf_size = (len - done > COPY_BUFFER_SIZE) ? COPY_BUFFER_SIZE : (size_t)(len - done);
+    char *buf = malloc(buf_size);
+    if (!buf) return -1;
+
+    while (done < len) {
+        size_t to_read = (len - done > (off_t)buf_size) ? buf_size : (size_t)(len - done);
+        ssize_t br = pread(in_fd, buf, to_read, in_off + done);
+        if (br == -1) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return -1;
         }
+        if (br == 0) break;
+        if (write_all(out_fd, buf, br, out_off + done) == -1) {
+            free(buf);
+            return -1;
+        }
+        done += br;
     }
+    free(buf);
+    return done;
+}
 
-    if (r == -1) {
-        perror("compact: ошибка чтения архива");
-        close(in_fd);
-        close(tmp_fd);
-        unlink(tmp_name);
-        free(tmp_name);
-        return -1;
+/* Встроенный LZ в духе LZ4: последовательности
+   [токен: длина литералов << 4 | длина совпадения - 4][литералы][смещение, 2 байта],
+   длины от 15 продолжаются байтами до первого, меньшего 255.
+   Последняя последовательность - только литералы. */
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5      /* хвост блока - всегда литералы */
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+
+static uint32_t lz_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char *lz_put_length(unsigned char *op, const unsigned char *end, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= end) return NULL;
+        *op++ = 255;
     }
+    if (op >= end) return NULL;
+    *op++ = (unsigned char)len;
+    return op;
+}
 
-    /* flush & close */
-    fsync(tmp_fd);
-    close(tmp_fd);
-    close(in_fd);
+/* match_len == 0 - завершающие литералы. NULL - не хватило места. */
+static unsigned char *lz_put_sequence(unsigned char *op, const unsigned char *end,
+                                      const unsigned char *lit, size_t lit_len,
+                                      size_t offset, size_t match_len) {
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    if (op >= end) return NULL;
+    *op++ = (unsigned char)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit_len >= 15 && !(op = lz_put_length(op, end, lit_len - 15))) return NULL;
+    if ((size_t)(end - op) < lit_len) return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0) return op;
+    if (end - op < 2) return NULL;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    if (ml >= 15 && !(op = lz_put_length(op, end, ml - 15))) return NULL;
+    return op;
+}
 
-    /* заменить оригинал временным файлом */
-    if (rename(tmp_name, archive_name) == -1) {
-        perror("compact: не удалось заменить архив временным файлом");
-        unlink(tmp_name);
-        free(tmp_name);
-        return -1;
+static size_t lz_compress(const void *src_buf, size_t n, void *dst_buf, size_t cap) {
+    const unsigned char *src = src_buf;
+    unsigned char *dst = dst_buf, *op = dst;
+    const unsigned char *end = dst + cap;
+    uint32_t table[1 << LZ_HASH_BITS];
+    size_t ip = 0, anchor = 0;
+
+    memset(table, 0, sizeof(table));
+    while (ip + LZ_MIN_MATCH + LZ_LAST_LITERALS <= n) {
+        uint32_t v = lz_read32(src + ip);
+        uint32_t h = lz_hash(v);
+        size_t cand = table[h];
+        table[h] = ip;
+        if (cand >= ip || ip - cand > LZ_MAX_OFFSET || lz_read32(src + cand) != v) {
+            /* чем дольше нет совпадений, тем крупнее шаг: несжимаемое проходится быстро */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        size_t len = LZ_MIN_MATCH;
+        while (ip + len < n - LZ_LAST_LITERALS && src[cand + len] == src[ip + len]) len++;
+        while (ip > anchor && cand > 0 && src[ip - 1] == src[cand - 1]) {
+            ip--;
+            cand--;
+            len++;
+        }
+        op = lz_put_sequence(op, end, src + anchor, ip - anchor, ip - cand, len);
+        if (!op) return 0;
+        ip += len;
+        anchor = ip;
+        table[lz_hash(lz_read32(src + ip - 2))] = ip - 2;
     }
+    op = lz_put_sequence(op, end, src + anchor, n - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
 
-    free(tmp_name);
+static int lz_get_length(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
     return 0;
 }
 
-void archive_file(const char *archive_name, const char *file_name) {
-    int arch_fd = open(archive_name, O_WRONLY | O_CREAT | O_APPEND, 0666);
-    if (arch_fd == -1) {
-        perror("Не удалось открыть или создать архив");
-        return;
+static int lz_decompress(const void *src_buf, size_t n, void *dst_buf, size_t out_len) {
+    const unsigned char *ip = src_buf, *iend = ip + n;
+    unsigned char *dst = dst_buf;
+    size_t op = 0;
+
+    for (;;) {
+        if (ip >= iend) return -1;
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && lz_get_length(&ip, iend, &lit) == -1) return -1;
+        if ((size_t)(iend - ip) < lit || out_len - op < lit) return -1;
+        memcpy(dst + op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend) return op == out_len ? 0 : -1;
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t len = token & 15;
+        if (len == 15 && lz_get_length(&ip, iend, &len) == -1) return -1;
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || out_len - op < len) return -1;
+        /* совпадение может перекрываться с тем, что сейчас пишется */
+        unsigned char *d = dst + op;
+        const unsigned char *s = d - offset;
+        if (offset >= len) {
+            memcpy(d, s, len);
+        } else {
+            for (size_t i = 0; i < len; i++) d[i] = s[i];
+        }
+        op += len;
     }
+}
 
-    int in_fd = open(file_name, O_RDONLY);
-    if (in_fd == -1) {
-        perror("Не удалось открыть входной файл");
-        close(arch_fd);
-        return;
+/* Кодек сжимает один блок не длиннее CODEC_BLOCK.
+   compress возвращает 0, если результат не уместился в cap;
+   decompress должен получить ровно out_len байт, иначе -1. */
+struct codec {
+    unsigned char id;
+    const char *name;
+    size_t (*compress)(const void *src, size_t n, void *dst, size_t cap);
+    int (*decompress)(const void *src, size_t n, void *dst, size_t out_len);
+};
+
+static const struct codec codecs[] = {
+    {CODEC_LZ, "lz", lz_compress, lz_decompress},
+};
+
+static const struct codec *codec_by_id(unsigned id) {
+    for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+        if (codecs[i].id == id) return &codecs[i];
     }
+    return NULL;
+}
 
-    struct file_header header;
+static const struct codec *codec_by_name(const char *name) {
+    for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+        if (strcmp(codecs[i].name, name) == 0) return &codecs[i];
+    }
+    return NULL;
+}
 
-    if (strlen(file_name) >= sizeof(header.name)) {
-        printf("Ошибка: имя файла '%s' слишком длинное (максимум %zu символов)\n",
-               file_name, sizeof(header.name) - 1);
-        close(in_fd);
-        close(arch_fd);
-        return;
+/* Сжатые данные записи - кадры [uint32 длина][блок]; блок распаковывается
+   в CODEC_BLOCK байт, последний - в остаток файла. Блок, который не
+   ужался, кладётся как есть с CODEC_STORED_BIT. */
+#define CODEC_FRAME_MAX (sizeof(uint32_t) + CODEC_BLOCK)
+
+static size_t compress_frame(const struct codec *codec, const char *src, size_t n, char *frame) {
+    uint32_t len = codec->compress(src, n, frame + sizeof(len), n - 1);
+    if (len == 0) {
+        memcpy(frame + sizeof(len), src, n);
+        len = n | CODEC_STORED_BIT;
     }
-    memset(&header, 0, sizeof(header));
-    strncpy(header.name, file_name, sizeof(header.name) - 1);
+    memcpy(frame, &len, sizeof(len));
+    return sizeof(len) + (len & ~CODEC_STORED_BIT);
+}
 
-    if (fstat(in_fd, &header.metadata) == -1) {
-        perror("Не удалось получить метаданные файла");
-        close(in_fd);
-        close(arch_fd);
-        return;
+struct frame_batch {
+    const struct codec *codec;
+    const char *src;
+    size_t len;
+    char *out;                      /* по CODEC_FRAME_MAX на блок */
+    size_t sizes[CODEC_GROUP_BLOCKS];
+    size_t count;
+    size_t next;
+};
+
+static void *frame_thread(void *arg) {
+    struct frame_batch *b = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count) {
+        size_t off = i * CODEC_BLOCK;
+        size_t n = b->len - off < CODEC_BLOCK ? b->len - off : CODEC_BLOCK;
+        b->sizes[i] = compress_frame(b->codec, b->src + off, n, b->out + i * CODEC_FRAME_MAX);
     }
-    header.is_deleted = 0;
+    return NULL;
+}
 
-    if (write(arch_fd, &header, sizeof(header)) != sizeof(header)) {
-        perror("Ошибка записи заголовка в архив");
-        close(in_fd);
-        close(arch_fd);
-        return;
+/* Сжать до CODEC_GROUP_BLOCKS блоков в nthreads потоков (вызывающий -
+   один из них). Кадры собираются подряд в начале out; возвращает их размер. */
+static size_t compress_frames(const struct codec *codec, const char *src, size_t len,
+                              char *out, size_t nthreads) {
+    struct frame_batch b = {codec, src, len, out, {0}, (len + CODEC_BLOCK - 1) / CODEC_BLOCK, 0};
+    pthread_t threads[CODEC_GROUP_BLOCKS];
+    size_t started = 0;
+
+    if (nthreads > b.count) nthreads = b.count;
+    while (started + 1 < nthreads
+           && pthread_create(&threads[started], NULL, frame_thread, &b) == 0) {
+        started++;
+    }
+    frame_thread(&b);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
     }
 
-    char buffer[4096];
-    ssize_t bytes_read, bytes_written;
-    while ((bytes_read = read(in_fd, buffer, sizeof(buffer))) > 0) {
-        bytes_written = write(arch_fd, buffer, bytes_read);
-        if (bytes_written != bytes_read) {
-            perror("Ошибка записи данных в архив");
-            close(in_fd);
-            close(arch_fd);
-            return;
-        }
+    size_t total = 0;
+    for (size_t i = 0; i < b.count; i++) {
+        memmove(out + total, out + i * CODEC_FRAME_MAX, b.sizes[i]);
+        total += b.sizes[i];
     }
+    return total;
+}
 
-    if (bytes_read == -1) {
-        perror("Ошибка чтения исходного файла");
-        close(in_fd);
-        close(arch_fd);
-        return;
+/* Сжатие окупается, только если экономит не меньше CODEC_MIN_SAVING% */
+static int compression_pays(size_t packed, size_t len) {
+    return packed * 100 <= len * (100 - CODEC_MIN_SAVING);
+}
+
+void archive_init(struct archive *arch, int fd) {
+    memset(arch, 0, sizeof(*arch));
+    arch->fd = fd;
+    arch->version = ARCHIVE_VERSION;
+}
+
+/* Слот с именем записи или пустой слот, куда оно ляжет */
+static size_t archive_slot(const struct archive *arch, uint64_t hash, const char *name) {
+    size_t j = hash & arch->slot_mask;
+    while (arch->slots[j]) {
+        const struct index_entry *e = &arch->entries[arch->slots[j] - 1];
+        if (e->name_hash == hash && strcmp(arch->names + e->name_offset, name) == 0) break;
+        j = (j + 1) & arch->slot_mask;
     }
+    return j;
+}
 
-    printf("Файл '%s' успешно добавлен в архив '%s'.\n", file_name, archive_name);
+static void archive_link_name(struct archive *arch, size_t i) {
+    const struct index_entry *e = &arch->entries[i];
+    size_t j = archive_slot(arch, e->name_hash, arch->names + e->name_offset);
+    arch->prev[i] = arch->slots[j];
+    arch->slots[j] = i + 1;
+}
 
-    close(in_fd);
-    close(arch_fd);
+/* Внести в таблицу имён записи, добавленные после прошлого поиска; при
+   заполнении больше чем наполовину таблица удваивается и строится заново */
+static int archive_index_names(struct archive *arch) {
+    if (arch->count > UINT32_MAX - 1) return -1;
+    if (arch->indexed == arch->count && arch->slots) return 0;
+    if (arch->count * 2 >= arch->slot_mask) {
+        size_t size = 64;
+        while (size < arch->count * 2 + 2) size *= 2;
+        uint32_t *slots = calloc(size, sizeof(*slots));
+        uint32_t *prev = realloc(arch->prev, (arch->count ? arch->count : 1) * sizeof(*prev));
+        if (prev) arch->prev = prev;
+        if (!slots || !prev) {
+            free(slots);
+            return -1;
+        }
+        free(arch->slots);
+        arch->slots = slots;
+        arch->slot_mask = size - 1;
+        arch->indexed = 0;
+    } else {
+        uint32_t *prev = realloc(arch->prev, arch->count * sizeof(*prev));
+        if (!prev) return -1;
+        arch->prev = prev;
+    }
+    for (; arch->indexed < arch->count; arch->indexed++) {
+        archive_link_name(arch, arch->indexed);
+    }
+    return 0;
 }
 
-void extract_file(const char *archive_name, const char *file_name) {
-    int arch_fd = open(archive_name, O_RDWR);
-    if (arch_fd == -1) {
-        perror("Не удалось открыть архив");
-        return;
+int archive_add_entry(struct archive *arch, const char *name, off_t offset,
+                      off_t size, off_t file_size, time_t mtime, uint32_t flags) {
+    size_t name_len = strlen(name) + 1;
+
+    if (arch->count == arch->capacity) {
+        size_t cap = arch->capacity ? arch->capacity * 2 : 64;
+        struct index_entry *entries = realloc(arch->entries, cap * sizeof(*entries));
+        if (!entries) return -1;
+        arch->entries = entries;
+        arch->capacity = cap;
+    }
+    if (arch->names_size + name_len > arch->names_capacity) {
+        size_t cap = arch->names_capacity ? arch->names_capacity * 2 : 4096;
+        while (cap < arch->names_size + name_len) cap *= 2;
+        char *names = realloc(arch->names, cap);
+        if (!names) return -1;
+        arch->names = names;
+        arch->names_capacity = cap;
     }
 
+    struct index_entry *e = &arch->entries[arch->count++];
+    e->name_hash = hash_name(name);
+    e->offset = offset;
+    e->size = size;
+    e->file_size = file_size;
+    e->mtime = mtime;
+    e->name_offset = arch->names_size;
+    e->flags = flags;
+    memcpy(arch->names + arch->names_size, name, name_len);
+    arch->names_size += name_len;
+    return 0;
+}
+
+/* Построить оглавление старого архива проходом по заголовкам */
+static int archive_scan_legacy(struct archive *arch, off_t file_size) {
     struct file_header header;
-    ssize_t bytes_read;
-    int found = 0;
+    off_t offset = 0;
 
-    while (1) {
-        off_t header_start = lseek(arch_fd, 0, SEEK_CUR);
-        if (header_start == -1) {
-            perror("Ошибка определения позиции в архиве");
+    arch->version = 0;
+    while (offset < file_size) {
+        ssize_t r = pread(arch->fd, &header, sizeof(header), offset);
+        if (r == -1) {
+            perror("Ошибка чтения заголовка из архива");
+            return -1;
+        }
+        if (r != sizeof(header) || header.metadata.st_size < 0
+            || header.metadata.st_size > file_size - offset - (off_t)sizeof(header)) {
+            fprintf(stderr, "Архив повреждён: неполная запись по смещению %lld\n", (long long)offset);
             break;
         }
+        header.name[sizeof(header.name) - 1] = '\0';
+        if (archive_add_entry(arch, header.name, offset, header.metadata.st_size, header.metadata.st_size,
+                              header.metadata.st_mtime, header.is_deleted ? INDEX_DELETED : 0) == -1) {
+            perror("Недостаточно памяти для оглавления");
+            return -1;
+        }
+        offset += sizeof(header) + header.metadata.st_size;
+    }
+    arch->data_end = offset;
+    return 0;
+}
 
-        bytes_read = read(arch_fd, &header, sizeof(header));
-        if (bytes_read == 0) break; /* EOF */
-        if (bytes_read != sizeof(header)) {
-            perror("Ошибка чтения заголовка из архива");
-            break;
+/* Закончить компактацию по журналу: зафиксированный образ переносится на
+   место, иначе файл возвращается к прежнему размеру. Повторный вызов после
+   сбоя посреди переноса даёт тот же результат. */
+static int journal_apply(int fd, off_t size, const struct compact_journal *journal) {
+    uint64_t room = size - sizeof(*journal);
+    if (journal->state == JOURNAL_STAGING) {
+        if (journal->old_size > room) {
+            errno = EINVAL;
+            return -1;
         }
+        if (ftruncate(fd, journal->old_size) == -1 || fsync(fd) == -1) return -1;
+        return 0;
+    }
+    /* образ лежит целиком за своим местом назначения */
+    if (journal->state != JOURNAL_COMMITTED || journal->len > room
+        || journal->dst > room - journal->len
+        || journal->len > room - journal->len - journal->dst) {
+        errno = EINVAL;
+        return -1;
+    }
+    off_t src = room - journal->len;
+    if (copy_data(fd, src, fd, journal->dst, journal->len) != (off_t)journal->len
+        || ftruncate(fd, journal->dst + journal->len) == -1 || fsync(fd) == -1) {
+        return -1;
+    }
+    return 0;
+}
 
-        /* если совпадает имя и не помечен как удалённый — извлекаем */
-        if (strcmp(header.name, file_name) == 0 && !header.is_deleted) {
-            found = 1;
+static int archive_load(struct archive *arch) {
+    struct stat st;
+    struct archive_footer footer;
+    struct compact_journal journal;
 
-            if (header.metadata.st_size > MAX_FILE_SIZE) {
-                printf("Файл '%s' слишком большой для извлечения (размер: %lld байт)\n",
-                       file_name, (long long)header.metadata.st_size);
-                /* пропустим данные и выйдем */
-                if (lseek(arch_fd, header.metadata.st_size, SEEK_CUR) == -1) {
-                    perror("Ошибка пропуска данных большого файла");
-                }
-                break;
+    if (fstat(arch->fd, &st) == -1) {
+        perror("Не удалось получить размер архива");
+        return -1;
+    }
+    if (st.st_size >= (off_t)sizeof(journal)
+        && pread(arch->fd, &journal, sizeof(journal), st.st_size - sizeof(journal)) == sizeof(journal)
+        && memcmp(journal.magic, JOURNAL_MAGIC, sizeof(journal.magic)) == 0) {
+        if ((fcntl(arch->fd, F_GETFL) & O_ACCMODE) == O_RDONLY) {
+            fprintf(stderr, "Компактация архива была прервана; -c или -e её завершат\n");
+            return -1;
+        }
+        if (journal_apply(arch->fd, st.st_size, &journal) == -1 || fstat(arch->fd, &st) == -1) {
+            perror("Не удалось восстановить архив после прерванной компактации");
+            return -1;
+        }
+        fprintf(stderr, "Прерванная компактация архива %s\n",
+                journal.state == JOURNAL_COMMITTED ? "завершена" : "отменена");
+    }
+    if (st.st_size < (off_t)sizeof(footer)
+        || pread(arch->fd, &footer, sizeof(footer), st.st_size - sizeof(footer)) != sizeof(footer)
+        || memcmp(footer.magic, ARCHIVE_MAGIC, sizeof(footer.magic)) != 0) {
+        return archive_scan_legacy(arch, st.st_size);
+    }
+
+    if (footer.version > ARCHIVE_VERSION) {
+        fprintf(stderr, "Неподдерживаемая версия архива: %u\n", footer.version);
+        return -1;
+    }
+    size_t record_size = footer.version == 1 ? sizeof(struct index_entry_v1) : sizeof(struct index_entry);
+    /* Каждое слагаемое сверяется с остатком файла: сумма не переполнится */
+    uint64_t rest = st.st_size - sizeof(footer);
+    uint64_t entries_size = 0;
+    int valid = footer.index_offset <= rest;
+    if (valid) {
+        rest -= footer.index_offset;
+        valid = footer.entry_count <= rest / record_size;
+    }
+    if (valid) {
+        entries_size = footer.entry_count * record_size;
+        rest -= entries_size;
+        valid = footer.names_size == rest;
+    }
+    if (!valid) {
+        fprintf(stderr, "Архив повреждён: неверное оглавление\n");
+        return -1;
+    }
+
+    arch->version = footer.version;
+    arch->count = arch->capacity = footer.entry_count;
+    arch->names_size = arch->names_capacity = footer.names_size;
+    arch->entries = malloc(footer.entry_count ? footer.entry_count * sizeof(struct index_entry) : 1);
+    arch->names = malloc(footer.names_size ? footer.names_size : 1);
+    if (!arch->entries || !arch->names) {
+        perror("Недостаточно памяти для оглавления");
+        return -1;
+    }
+
+    /* Всё оглавление - одним системным вызовом */
+    struct iovec iov[2] = {
+        {arch->entries, entries_size},
+        {arch->names, footer.names_size}
+    };
+    if (preadv(arch->fd, iov, 2, footer.index_offset) != (ssize_t)(entries_size + footer.names_size)) {
+        perror("Ошибка чтения оглавления архива");
+        return -1;
+    }
+    if (footer.version == 1) {
+        /* Расширить записи v1 на месте, с конца, чтобы не затереть непрочитанные */
+        const struct index_entry_v1 *old = (const struct index_entry_v1 *)arch->entries;
+        for (size_t i = arch->count; i > 0; i--) {
+            struct index_entry_v1 v1 = old[i - 1];
+            struct index_entry *e = &arch->entries[i - 1];
+            e->name_hash = v1.name_hash;
+            e->offset = v1.offset;
+            e->size = v1.size;
+            e->file_size = v1.size;
+            e->mtime = v1.mtime;
+            e->name_offset = v1.name_offset;
+            e->flags = v1.flags;
+        }
+    }
+    if (footer.names_size && arch->names[footer.names_size - 1] != '\0') {
+        fprintf(stderr, "Архив повреждён: неверная таблица имён\n");
+        return -1;
+    }
+    for (size_t i = 0; i < arch->count; i++) {
+        const struct index_entry *e = &arch->entries[i];
+        if (e->name_offset >= footer.names_size) {
+            fprintf(stderr, "Архив повреждён: неверная таблица имён\n");
+            return -1;
+        }
+        if (e->offset > footer.index_offset
+            || footer.index_offset - e->offset < sizeof(struct file_header)
+            || e->size > footer.index_offset - e->offset - sizeof(struct file_header)) {
+            fprintf(stderr, "Архив повреждён: запись %zu выходит за пределы данных\n", i);
+            return -1;
+        }
+    }
+    arch->data_end = footer.index_offset;
+    return 0;
+}
+
+/* Освободить оглавление в памяти, дескриптор остаётся открытым */
+static void archive_release(struct archive *arch) {
+    free(arch->entries);
+    free(arch->names);
+    free(arch->slots);
+    free(arch->prev);
+    arch->entries = NULL;
+    arch->names = NULL;
+    arch->slots = NULL;
+    arch->prev = NULL;
+    arch->slot_mask = arch->indexed = 0;
+}
+
+void archive_close(struct archive *arch) {
+    if (arch->fd != -1) close(arch->fd);
+    archive_release(arch);
+    arch->fd = -1;
+}
+
+int archive_open(const char *archive_name, int flags, struct archive *arch) {
+    int fd = open(archive_name, flags, 0666);
+    if (fd == -1) {
+        perror("Не удалось открыть архив");
+        return -1;
+    }
+    archive_init(arch, fd);
+    if (archive_load(arch) == -1) {
+        archive_close(arch);
+        return -1;
+    }
+    return 0;
+}
+
+/* Размер оглавления, имён и footer */
+static off_t archive_tail_size(const struct archive *arch) {
+    return arch->count * sizeof(struct index_entry) + arch->names_size + sizeof(struct archive_footer);
+}
+
+/* Записать оглавление и footer по смещению offset; footer указывает на
+   data_end, так что offset отличается от него только в образе компактации */
+static int archive_write_tail(const struct archive *arch, off_t offset) {
+    struct archive_footer footer;
+    size_t entries_size = arch->count * sizeof(struct index_entry);
+
+    memset(&footer, 0, sizeof(footer));
+    memcpy(footer.magic, ARCHIVE_MAGIC, sizeof(footer.magic));
+    footer.version = ARCHIVE_VERSION;
+    footer.entry_count = arch->count;
+    footer.index_offset = arch->data_end;
+    footer.names_size = arch->names_size;
+
+    if (write_all(arch->fd, arch->entries, entries_size, offset) == -1
+        || write_all(arch->fd, arch->names, arch->names_size, offset + entries_size) == -1
+        || write_all(arch->fd, &footer, sizeof(footer), offset + entries_size + arch->names_size) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Записать оглавление и footer сразу за данными */
+int archive_write_index(struct archive *arch) {
+    if (archive_write_tail(arch, arch->data_end) == -1
+        || ftruncate(arch->fd, arch->data_end + archive_tail_size(arch)) == -1) {
+        perror("Ошибка записи оглавления архива");
+        return -1;
+    }
+    arch->version = ARCHIVE_VERSION;
+    return 0;
+}
+
+/* Новейшая живая запись с этим именем: слот таблицы и цепочка prev */
+long archive_find(struct archive *arch, const char *name) {
+    if (archive_index_names(arch) == -1) {
+        perror("Недостаточно памяти для оглавления");
+        return -1;
+    }
+    for (size_t i = arch->slots[archive_slot(arch, hash_name(name), name)]; i; i = arch->prev[i - 1]) {
+        if (!(arch->entries[i - 1].flags & INDEX_DELETED)) return (long)(i - 1);
+    }
+    return -1;
+}
+
+/* Запись, на которую указывает жёсткая ссылка idx: последняя обычная
+   запись с этим именем перед ссылкой, живая или уже извлечённая */
+long archive_link_target(struct archive *arch, long idx) {
+    const struct index_entry *link = &arch->entries[idx];
+    char target[sizeof(((struct file_header *)0)->name)];
+
+    if (link->size >= sizeof(target)
+        || pread(arch->fd, target, link->size, link->offset + sizeof(struct file_header)) != (ssize_t)link->size) {
+        return -1;
+    }
+    target[link->size] = '\0';
+    if (archive_index_names(arch) == -1) return -1;
+
+    /* Цепочка имени идёт от новых записей к старым */
+    for (size_t i = arch->slots[archive_slot(arch, hash_name(target), target)]; i; i = arch->prev[i - 1]) {
+        if ((long)(i - 1) < idx && !(arch->entries[i - 1].flags & INDEX_HARDLINK)) return (long)(i - 1);
+    }
+    return -1;
+}
+
+/* Записи, которые переживут компактацию: живые и извлечённые, на которые
+   ещё ссылаются жёсткие ссылки. Возвращает calloc-массив или NULL. */
+static char *archive_live_map(struct archive *arch) {
+    char *live = calloc(arch->count ? arch->count : 1, 1);
+    if (!live) return NULL;
+
+    for (size_t i = 0; i < arch->count; i++) {
+        if (!(arch->entries[i].flags & INDEX_DELETED)) {
+            live[i] = 1;
+            if (arch->entries[i].flags & INDEX_HARDLINK) {
+                long target = archive_link_target(arch, i);
+                if (target != -1) live[target] = 1;
             }
+        }
+    }
+    return live;
+}
+
+/* Сколько байт освободит компактация */
+off_t archive_dead_bytes(const struct archive *arch, const char *live) {
+    off_t dead = 0;
+    for (size_t i = 0; i < arch->count; i++) {
+        if (!live[i]) dead += sizeof(struct file_header) + arch->entries[i].size;
+    }
+    return dead;
+}
+
+/* Сжимает архив на месте: живые записи сдвигаются к началу поверх удалённых,
+   оглавление пишется заново, файл обрезается. Извлечённые записи, на которые
+   ещё ссылаются жёсткие ссылки, остаются вместе с данными.
+   Сдвиг поверх самого себя нельзя повторить после сбоя, поэтому сначала за
+   концом файла собирается образ всего, что меняется (данные с первой удалённой
+   записи, оглавление, footer), и журнал за ним. Только после fsync журнал
+   помечается зафиксированным, и образ одним переносом ложится на место.
+   Прерванную компактацию доводит или откатывает archive_load. */
+int compact_in_place(struct archive *arch) {
+    char *live = archive_live_map(arch);
+    if (!live) {
+        perror("compact: недостаточно памяти");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(arch->fd, &st) == -1) {
+        perror("compact: не удалось получить размер архива");
+        free(live);
+        return -1;
+    }
+
+    /* Новая раскладка; всё до первой сдвигаемой записи остаётся на месте */
+    struct archive out;
+    archive_init(&out, arch->fd);
+    off_t write_pos = 0;
+    off_t keep = -1;
+    for (size_t i = 0; i < arch->count; i++) {
+        const struct index_entry *e = &arch->entries[i];
+        if (!live[i]) continue;
+        if (keep == -1 && (off_t)e->offset != write_pos) keep = write_pos;
+        if (archive_add_entry(&out, arch->names + e->name_offset, write_pos, e->size,
+                              e->file_size, e->mtime, e->flags) == -1) {
+            perror("compact: недостаточно памяти для оглавления");
+            free(live);
+            archive_release(&out);
+            return -1;
+        }
+        write_pos += sizeof(struct file_header) + e->size;
+    }
+    if (keep == -1) keep = write_pos;
+    out.data_end = write_pos;
+
+    struct compact_journal journal;
+    memset(&journal, 0, sizeof(journal));
+    memcpy(journal.magic, JOURNAL_MAGIC, sizeof(journal.magic));
+    journal.version = ARCHIVE_VERSION;
+    journal.state = JOURNAL_STAGING;
+    journal.old_size = st.st_size;
+    journal.dst = keep;
+    journal.len = (write_pos - keep) + archive_tail_size(&out);
+    /* образ не должен пересекаться ни с прежним архивом, ни с местом назначения */
+    off_t image = st.st_size > keep + (off_t)journal.len ? st.st_size : keep + (off_t)journal.len;
 
-            int out_fd = open(header.name, O_WRONLY | O_CREAT | O_TRUNC, header.metadata.st_mode);
-            if (out_fd == -1) {
-                perror("Не удалось создать файл для извлечения");
-                /* пропустим данные */
-                if (lseek(arch_fd, header.metadata.st_size, SEEK_CUR) == -1) {
-                    perror("Ошибка пропуска данных при неудачном создании файла");
-                }
+    int failed = write_all(arch->fd, &journal, sizeof(journal), image + journal.len) == -1
+                 || fsync(arch->fd) == -1;
+
+    /* Образ данных: подряд идущие живые записи копируются одним куском */
+    off_t pos = 0, run_src = 0, run_dst = 0, run_len = 0;
+    for (size_t i = 0; !failed && i <= arch->count; i++) {
+        const struct index_entry *e = i < arch->count ? &arch->entries[i] : NULL;
+        if (e && !live[i]) continue;
+        if (!e || (off_t)e->offset != run_src + run_len) {
+            if (run_len > 0 && copy_data(arch->fd, run_src, arch->fd, image + run_dst - keep, run_len) != run_len) {
+                failed = 1;
                 break;
             }
-
-            char buffer[4096];
-            off_t remaining = header.metadata.st_size;
-            ssize_t br, bw;
-            int read_error = 0;
-
-            while (remaining > 0) {
-                ssize_t to_read = (remaining > (off_t)sizeof(buffer)) ? sizeof(buffer) : (ssize_t)remaining;
-                br = read(arch_fd, buffer, to_read);
-                if (br <= 0) {
-                    if (br == -1) perror("Ошибка чтения из архива при извлечении");
-                    else fprintf(stderr, "Неожиданный EOF при извлечении\n");
-                    read_error = 1;
-                    break;
-                }
-                bw = write(out_fd, buffer, br);
-                if (bw != br) {
-                    perror("Ошибка записи извлеченного файла");
-                    read_error = 1;
-                    break;
-                }
-                remaining -= br;
+            run_len = 0;
+            if (!e) break;
+        }
+        off_t len = sizeof(struct file_header) + e->size;
+        if (pos >= keep) {
+            if (run_len == 0) {
+                run_src = e->offset;
+                run_dst = pos;
             }
+            run_len += len;
+        }
+        pos += len;
+    }
+    free(live);
 
-            if (read_error) {
-                close(out_fd);
-                break;
+    if (!failed) {
+        journal.state = JOURNAL_COMMITTED;
+        failed = archive_write_tail(&out, image + (write_pos - keep)) == -1
+                 || fsync(arch->fd) == -1
+                 || write_all(arch->fd, &journal, sizeof(journal), image + journal.len) == -1
+                 || fsync(arch->fd) == -1;
+    }
+    if (failed) {
+        /* Пока журнал не зафиксирован, прежний архив не тронут */
+        perror("compact: ошибка записи образа");
+        if (ftruncate(arch->fd, st.st_size) == -1) {
+            perror("compact: не удалось отбросить образ");
+        }
+        archive_release(&out);
+        return -1;
+    }
+
+    if (journal_apply(arch->fd, image + journal.len + sizeof(journal), &journal) == -1) {
+        /* Журнал на месте: следующее открытие на запись докончит перенос */
+        perror("compact: ошибка переноса данных");
+        archive_release(&out);
+        return -1;
+    }
+
+    out.version = ARCHIVE_VERSION;
+    archive_release(arch);
+    *arch = out;
+    return 0;
+}
+
+/* --compact: освободить место удалённых записей по требованию */
+int compact_archive(const char *archive_name) {
+    struct archive arch;
+    if (archive_open(archive_name, O_RDWR, &arch) == -1) {
+        return -1;
+    }
+
+    off_t before = arch.data_end;
+    int result = compact_in_place(&arch);
+    if (result == 0) {
+        printf("Архив '%s' сжат, освобождено %lld байт.\n",
+               archive_name, (long long)(before - arch.data_end));
+    }
+    archive_close(&arch);
+    return result;
+}
+
+/* Добавление файлов: воркеры открывают, stat-ят и читают входные файлы,
+   единственный писатель (главный поток) дописывает их в архив по порядку. */
+
+#define JOB_WAITING 0
+#define JOB_READY 1
+#define JOB_FAILED 2
+
+struct input_job {
+    char *name;                     /* имя в архиве */
+    int fd;
+    struct stat st;
+    char *data;                     /* файл целиком, если он маленький */
+    size_t data_len;                /* байт в data: сжатых, если codec */
+    size_t file_len;                /* байт прочитано из файла */
+    unsigned char codec;
+    struct sparse_extent *extents;  /* карта разреженного файла */
+    size_t extent_count;
+    int sparse;
+    int state;
+    int err;
+    const char *err_msg;
+    int written;
+};
+
+struct inode_slot {
+    dev_t dev;
+    ino_t ino;
+    long job;                       /* первое задание с этим inode, -1 - пусто */
+};
+
+struct input_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct input_job *jobs;
+    size_t count;
+    size_t capacity;
+    size_t next_job;                /* первое задание, не взятое воркером */
+    size_t next_write;              /* первое задание, не записанное писателем */
+    size_t in_flight;               /* байт прочитано, но ещё не записано */
+    const struct codec *codec;      /* NULL - без сжатия */
+    size_t nthreads;
+    struct inode_slot *inodes;      /* файлы с несколькими жёсткими ссылками */
+    size_t inode_capacity;
+    size_t inode_count;
+};
+
+static int add_input(struct input_queue *q, const char *name) {
+    if (strlen(name) >= sizeof(((struct file_header *)0)->name)) {
+        printf("Ошибка: имя файла '%s' слишком длинное (максимум %zu символов)\n",
+               name, sizeof(((struct file_header *)0)->name) - 1);
+        return -1;
+    }
+    if (q->count == q->capacity) {
+        size_t cap = q->capacity ? q->capacity * 2 : 64;
+        struct input_job *jobs = realloc(q->jobs, cap * sizeof(*jobs));
+        if (!jobs) {
+            perror("Недостаточно памяти для списка файлов");
+            return -1;
+        }
+        q->jobs = jobs;
+        q->capacity = cap;
+    }
+    struct input_job *job = &q->jobs[q->count];
+    memset(job, 0, sizeof(*job));
+    job->fd = -1;
+    job->name = strdup(name);
+    if (!job->name) {
+        perror("Недостаточно памяти для списка файлов");
+        return -1;
+    }
+    q->count++;
+    return 0;
+}
+
+struct dir_item {
+    char *name;
+    unsigned char type;             /* d_type */
+};
+
+static int compare_items(const void *a, const void *b) {
+    return strcmp(((const struct dir_item *)a)->name, ((const struct dir_item *)b)->name);
+}
+
+/* Обойти каталог; имена сортируются, чтобы архив не зависел от порядка readdir.
+   -1, если что-то из каталога не попало в очередь. */
+static int collect_directory(struct input_queue *q, const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "Не удалось открыть каталог '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct dir_item *items = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            items = realloc(items, capacity * sizeof(*items));
+            if (!items) {
+                perror("Недостаточно памяти для списка файлов");
+                exit(1);
             }
+        }
+        items[count].name = strdup(de->d_name);
+        items[count].type = de->d_type;
+        if (!items[count].name) {
+            perror("Недостаточно памяти для списка файлов");
+            exit(1);
+        }
+        count++;
+    }
+    closedir(dir);
+    qsort(items, count, sizeof(*items), compare_items);
 
-            close(out_fd);
+    size_t path_len = strlen(path);
+    while (path_len > 1 && path[path_len - 1] == '/') path_len--;
 
-            /* Восстановить атрибуты */
-            if (chmod(header.name, header.metadata.st_mode) == -1) {
-                perror("Предупреждение: не удалось восстановить права доступа");
+    int result = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t len = path_len + 1 + strlen(items[i].name) + 1;
+        char *child = malloc(len);
+        if (!child) {
+            perror("Недостаточно памяти для списка файлов");
+            exit(1);
+        }
+        snprintf(child, len, "%.*s/%s", (int)path_len, path, items[i].name);
+
+        unsigned char type = items[i].type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(child, &st) == -1) {
+                fprintf(stderr, "Не удалось получить метаданные '%s': %s\n", child, strerror(errno));
+                result = -1;
+            } else if (S_ISDIR(st.st_mode)) {
+                type = DT_DIR;
+            } else if (S_ISREG(st.st_mode)) {
+                type = DT_REG;
             }
-            if (chown(header.name, header.metadata.st_uid, header.metadata.st_gid) == -1) {
-                /* Часто не удаётся если не root — это не критично */
-                /* perror("Предупреждение: не удалось восстановить владельца"); */
+        }
+        /* Символические ссылки внутри каталогов не разыменовываются */
+        if (type == DT_DIR) {
+            if (collect_directory(q, child) == -1) result = -1;
+        } else if (type == DT_REG) {
+            if (add_input(q, child) == -1) result = -1;
+        } else if (type != DT_UNKNOWN) {
+            fprintf(stderr, "Пропущен '%s': не обычный файл\n", child);
+        }
+        free(child);
+        free(items[i].name);
+    }
+    free(items);
+    return result;
+}
+
+/* Первое задание с тем же inode; иначе запоминает это. Под q->lock. */
+static long claim_inode(struct input_queue *q, const struct stat *st, long job) {
+    if (q->inode_count * 2 >= q->inode_capacity) {
+        size_t cap = q->inode_capacity ? q->inode_capacity * 2 : 256;
+        struct inode_slot *slots = malloc(cap * sizeof(*slots));
+        if (!slots) return job;
+        for (size_t i = 0; i < cap; i++) slots[i].job = -1;
+        for (size_t i = 0; i < q->inode_capacity; i++) {
+            if (q->inodes[i].job == -1) continue;
+            size_t h = (q->inodes[i].ino * 0x9E3779B97F4A7C15ULL ^ q->inodes[i].dev) & (cap - 1);
+            while (slots[h].job != -1) h = (h + 1) & (cap - 1);
+            slots[h] = q->inodes[i];
+        }
+        free(q->inodes);
+        q->inodes = slots;
+        q->inode_capacity = cap;
+    }
+
+    size_t h = (st->st_ino * 0x9E3779B97F4A7C15ULL ^ st->st_dev) & (q->inode_capacity - 1);
+    while (q->inodes[h].job != -1) {
+        if (q->inodes[h].dev == st->st_dev && q->inodes[h].ino == st->st_ino) {
+            if (job < q->inodes[h].job) q->inodes[h].job = job;
+            return q->inodes[h].job;
+        }
+        h = (h + 1) & (q->inode_capacity - 1);
+    }
+    q->inodes[h].dev = st->st_dev;
+    q->inodes[h].ino = st->st_ino;
+    q->inodes[h].job = job;
+    q->inode_count++;
+    return job;
+}
+
+/* Карта экстентов через SEEK_DATA/SEEK_HOLE.
+   Возвращает число экстентов или -1, если файл лучше хранить как обычный. */
+static long map_extents(int fd, off_t size, struct sparse_extent **out) {
+    struct sparse_extent *extents = NULL;
+    size_t count = 0, capacity = 0;
+    off_t pos = 0;
+
+    while (pos < size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data == -1) {
+            if (errno == ENXIO) break;  /* дальше только дыра */
+            free(extents);
+            return -1;                  /* ФС не умеет SEEK_DATA */
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1 || hole > size) hole = size;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            struct sparse_extent *grown = realloc(extents, capacity * sizeof(*extents));
+            if (!grown) {
+                free(extents);
+                return -1;
             }
+            extents = grown;
+        }
+        extents[count].offset = data;
+        extents[count].length = hole - data;
+        count++;
+        pos = hole;
+    }
+
+    if (count == 1 && extents[0].offset == 0 && (off_t)extents[0].length == size) {
+        free(extents);
+        return -1;
+    }
+    *out = extents;
+    return count;
+}
+
+static void prepare_input(struct input_queue *q, size_t j) {
+    struct input_job *job = &q->jobs[j];
+    int state = JOB_READY;
+
+    job->fd = open(job->name, O_RDONLY);
+    if (job->fd == -1) {
+        job->err = errno;
+        job->err_msg = "Не удалось открыть входной файл";
+        state = JOB_FAILED;
+        goto done;
+    }
+    if (fstat(job->fd, &job->st) == -1) {
+        job->err = errno;
+        job->err_msg = "Не удалось получить метаданные файла";
+        state = JOB_FAILED;
+        goto done;
+    }
+
+    if (S_ISREG(job->st.st_mode) && job->st.st_nlink > 1) {
+        pthread_mutex_lock(&q->lock);
+        long first = claim_inode(q, &job->st, j);
+        pthread_mutex_unlock(&q->lock);
+        /* Данные уже будут в архиве, писатель сохранит только ссылку */
+        if (first != (long)j) goto done;
+    }
 
-            struct utimbuf times = {header.metadata.st_atime, header.metadata.st_mtime};
-            if (utime(header.name, &times) == -1) {
-                perror("Предупреждение: не удалось восстановить время модификации");
+    if (S_ISREG(job->st.st_mode) && job->st.st_blocks * 512 < job->st.st_size) {
+        long count = map_extents(job->fd, job->st.st_size, &job->extents);
+        if (count >= 0) {
+            job->extent_count = count;
+            job->sparse = 1;
+            goto done;
+        }
+    }
+
+    /* Маленькие файлы читаются здесь; большие писатель копирует сам
+       через copy_data, не гоняя их через память */
+    if (job->st.st_size > INPUT_SMALL_MAX || job->st.st_size == 0) goto done;
+
+    size_t size = job->st.st_size;
+    pthread_mutex_lock(&q->lock);
+    /* Задание, которого ждёт писатель, проходит сверх бюджета, иначе
+       бюджет могли бы целиком занять задания, стоящие за ним */
+    while (q->in_flight + size > INPUT_BUDGET && j != q->next_write) {
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+    q->in_flight += size;
+    pthread_mutex_unlock(&q->lock);
+
+    job->data = malloc(size);
+    size_t got = 0;
+    while (job->data && got < size) {
+        ssize_t r = pread(job->fd, job->data + got, size - got, got);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) {
+            if (r == -1) {
+                job->err = errno;
+                job->err_msg = "Ошибка чтения исходного файла";
+                state = JOB_FAILED;
             }
+            break;
+        }
+        got += r;
+    }
+    if (!job->data) {
+        job->err = ENOMEM;
+        job->err_msg = "Ошибка чтения исходного файла";
+        state = JOB_FAILED;
+    }
+    job->data_len = job->file_len = got;
+    pthread_mutex_lock(&q->lock);
+    q->in_flight -= size - got;
+    pthread_mutex_unlock(&q->lock);
 
-            /* Пометить запись как удалённую в архиве */
-            header.is_deleted = 1;
-            if (lseek(arch_fd, header_start, SEEK_SET) == -1) {
-                perror("Ошибка позиционирования в архиве для пометки удаления");
-            } else if (write(arch_fd, &header, sizeof(header)) != sizeof(header)) {
-                perror("Ошибка записи пометки удаления в архив");
+    /* Маленькие файлы сжимаются целиком здесь: параллельно по файлам */
+    if (q->codec && state == JOB_READY && got > 0) {
+        size_t blocks = (got + CODEC_BLOCK - 1) / CODEC_BLOCK;
+        char *packed = malloc(blocks * CODEC_FRAME_MAX);
+        if (packed) {
+            size_t len = compress_frames(q->codec, job->data, got, packed, 1);
+            if (compression_pays(len, got)) {
+                free(job->data);
+                job->data = packed;
+                job->data_len = len;
+                job->codec = q->codec->id;
+                packed = NULL;
             }
+            free(packed);
+        }
+    }
+
+done:
+    pthread_mutex_lock(&q->lock);
+    job->state = state;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *input_worker(void *arg) {
+    struct input_queue *q = arg;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        /* Не уходить далеко вперёд писателя: каждое задание держит открытый файл */
+        while (q->next_job < q->count && q->next_job >= q->next_write + INPUT_AHEAD_MAX) {
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        if (q->next_job >= q->count) break;
+        size_t j = q->next_job++;
+        pthread_mutex_unlock(&q->lock);
+        prepare_input(q, j);
+        pthread_mutex_lock(&q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+/* Сжать большой файл в архив группами блоков, блоки группы - параллельно.
+   1 - первая группа почти не ужалась, файл надо копировать как есть. */
+static int write_compressed(struct input_queue *q, int in_fd, int out_fd, off_t data_off,
+                            off_t *stored, off_t *file_len) {
+    size_t group = CODEC_GROUP_BLOCKS * CODEC_BLOCK;
+    char *in = malloc(group);
+    char *out = malloc(CODEC_GROUP_BLOCKS * CODEC_FRAME_MAX);
+    off_t in_pos = 0, out_pos = 0;
+    int result = 0;
+
+    if (!in || !out) {
+        free(in);
+        free(out);
+        return 1;
+    }
+    for (;;) {
+        size_t got = 0;
+        while (got < group) {
+            ssize_t r = pread(in_fd, in + got, group - got, in_pos + got);
+            if (r == -1 && errno == EINTR) continue;
+            if (r == -1) result = -1;
+            if (r <= 0) break;
+            got += r;
+        }
+        if (result == -1 || got == 0) break;
+
+        size_t packed = compress_frames(q->codec, in, got, out, q->nthreads);
+        if (in_pos == 0 && !compression_pays(packed, got)) {
+            result = 1;
+            break;
+        }
+        if (write_all(out_fd, out, packed, data_off + out_pos) == -1) {
+            result = -1;
+            break;
+        }
+        in_pos += got;
+        out_pos += packed;
+        if (got < group) break;
+    }
+    free(in);
+    free(out);
+    *stored = out_pos;
+    *file_len = in_pos;
+    return result;
+}
 
-            /* Закрываем дескриптор и запускаем компактацию архива */
-            close(arch_fd);
-            if (compact_archive(archive_name) == -1) {
-                fprintf(stderr, "Предупреждение: не удалось сжать архив после удаления. Архив корректно помечен, но размер может остаться прежним.\n");
+/* Записать задание в конец данных архива; 0 - успех */
+static int write_input(struct archive *arch, struct input_queue *q, size_t j) {
+    struct input_job *job = &q->jobs[j];
+    struct file_header header;
+    off_t header_off = arch->data_end;
+    off_t data_off = header_off + sizeof(header);
+    off_t stored;
+    uint32_t flags = 0;
+
+    memset(&header, 0, sizeof(header));
+    strncpy(header.name, job->name, sizeof(header.name) - 1);
+    header.metadata = job->st;
+
+    long first = (long)j;
+    if (S_ISREG(job->st.st_mode) && job->st.st_nlink > 1) {
+        pthread_mutex_lock(&q->lock);
+        first = claim_inode(q, &job->st, j);
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    if (first != (long)j && q->jobs[first].written) {
+        /* Жёсткая ссылка: вместо данных - имя первой записи */
+        const char *target = q->jobs[first].name;
+        stored = strlen(target);
+        header.flags = ENTRY_HARDLINK;
+        flags = INDEX_HARDLINK;
+        if (write_all(arch->fd, target, stored, data_off) == -1) {
+            perror("Ошибка записи данных в архив");
+            return -1;
+        }
+    } else if (job->sparse) {
+        uint64_t count = job->extent_count;
+        size_t map_size = count * sizeof(struct sparse_extent);
+        header.flags = ENTRY_SPARSE;
+        flags = INDEX_SPARSE;
+        if (write_all(arch->fd, &count, sizeof(count), data_off) == -1
+            || write_all(arch->fd, job->extents, map_size, data_off + sizeof(count)) == -1) {
+            perror("Ошибка записи данных в архив");
+            return -1;
+        }
+        stored = sizeof(count) + map_size;
+        for (size_t i = 0; i < job->extent_count; i++) {
+            off_t copied = copy_data(job->fd, job->extents[i].offset, arch->fd,
+                                     data_off + stored, job->extents[i].length);
+            if (copied != (off_t)job->extents[i].length) {
+                if (copied == -1) perror("Ошибка записи данных в архив");
+                else fprintf(stderr, "Файл '%s' изменился во время чтения\n", job->name);
+                return -1;
             }
+            stored += copied;
+        }
+    } else if (job->data) {
+        if (write_all(arch->fd, job->data, job->data_len, data_off) == -1) {
+            perror("Ошибка записи данных в архив");
+            return -1;
+        }
+        stored = job->data_len;
+        header.metadata.st_size = job->file_len;
+        header.codec = job->codec;
+    } else {
+        off_t file_len;
+        int plain = 1;
+        if (q->codec && job->st.st_size > 0) {
+            plain = write_compressed(q, job->fd, arch->fd, data_off, &stored, &file_len);
+        }
+        if (plain == 1) {
+            stored = file_len = copy_data(job->fd, 0, arch->fd, data_off, job->st.st_size);
+        } else if (plain == 0) {
+            header.codec = q->codec->id;
+        }
+        if (plain == -1 || stored == -1) {
+            perror("Ошибка записи данных в архив");
+            return -1;
+        }
+        /* файл мог уменьшиться, пока его читали */
+        header.metadata.st_size = file_len;
+    }
+    flags |= (uint32_t)header.codec << INDEX_CODEC_SHIFT;
 
-            printf("Файл '%s' извлечен и удалён из архива.\n", file_name);
-            return;
+    if (write_all(arch->fd, &header, sizeof(header), header_off) == -1) {
+        perror("Ошибка записи заголовка в архив");
+        return -1;
+    }
+    if (archive_add_entry(arch, header.name, header_off, stored, header.metadata.st_size,
+                          header.metadata.st_mtime, flags) == -1) {
+        perror("Недостаточно памяти для оглавления");
+        return -1;
+    }
+    arch->data_end = data_off + stored;
+    return 0;
+}
+
+/* Добавить файлы в архив; -1, если хотя бы один не добавлен */
+int archive_files(const char *archive_name, char **paths, size_t npaths, const struct codec *codec) {
+    struct input_queue q;
+    int result = 0;
+    memset(&q, 0, sizeof(q));
+    q.codec = codec;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+
+    /* Аргументы командной строки разыменовываются, как и раньше */
+    for (size_t i = 0; i < npaths; i++) {
+        struct stat st;
+        if (stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (collect_directory(&q, paths[i]) == -1) result = -1;
+        } else if (add_input(&q, paths[i]) == -1) {
+            result = -1;
+        }
+    }
+
+    struct archive arch;
+    if (q.count == 0) goto out;
+    if (archive_open(archive_name, O_RDWR | O_CREAT, &arch) == -1) {
+        result = -1;
+        goto out;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = cpus > 0 ? (size_t)cpus : 1;
+    if (nthreads > INPUT_THREADS_MAX) nthreads = INPUT_THREADS_MAX;
+    /* большие файлы писатель сжимает сам, на все ядра */
+    q.nthreads = nthreads;
+    if (nthreads > q.count) nthreads = q.count;
+
+    pthread_t threads[INPUT_THREADS_MAX];
+    size_t started = 0;
+    for (size_t i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, input_worker, &q) != 0) break;
+        started++;
+    }
+    for (size_t j = 0; j < q.count; j++) {
+        struct input_job *job = &q.jobs[j];
+
+        /* Если потоки не создались, писатель готовит задания сам */
+        if (started == 0) {
+            prepare_input(&q, j);
+        }
+
+        pthread_mutex_lock(&q.lock);
+        while (job->state == JOB_WAITING) {
+            pthread_cond_wait(&q.cond, &q.lock);
+        }
+        pthread_mutex_unlock(&q.lock);
+
+        if (job->state == JOB_FAILED) {
+            fprintf(stderr, "%s '%s': %s\n", job->err_msg, job->name, strerror(job->err));
+            result = -1;
+        } else if (write_input(&arch, &q, j) == 0) {
+            job->written = 1;
+            printf("Файл '%s' успешно добавлен в архив '%s'.\n", job->name, archive_name);
         } else {
-            /* Пропустить данные этой записи и продолжить */
-            if (lseek(arch_fd, header.metadata.st_size, SEEK_CUR) == -1) {
-                perror("Ошибка позиционирования в архиве при пропуске записи");
-                break;
-            }
+            result = -1;
+        }
+
+        if (job->fd != -1) close(job->fd);
+        free(job->data);
+        free(job->extents);
+
+        pthread_mutex_lock(&q.lock);
+        q.next_write = j + 1;
+        q.in_flight -= job->file_len;
+        pthread_cond_broadcast(&q.cond);
+        pthread_mutex_unlock(&q.lock);
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (archive_write_index(&arch) == -1) result = -1;
+    archive_close(&arch);
+
+out:
+    for (size_t j = 0; j < q.count; j++) {
+        free(q.jobs[j].name);
+    }
+    free(q.jobs);
+    free(q.inodes);
+    pthread_cond_destroy(&q.cond);
+    pthread_mutex_destroy(&q.lock);
+    return result;
+}
+
+/* Создать недостающие каталоги на пути к файлу */
+static void make_parent_dirs(const char *path) {
+    char buf[sizeof(((struct file_header *)0)->name)];
+    size_t len = strlen(path);
+    if (len >= sizeof(buf)) return;
+    memcpy(buf, path, len + 1);
+
+    for (char *p = buf + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(buf, 0777) == -1 && errno != EEXIST) {
+            perror("Не удалось создать каталог для извлечения");
+            return;
+        }
+        *p = '/';
+    }
+}
+
+/* Распаковать кадры сжатой записи в out_fd */
+static int extract_frames(const struct archive *arch, const struct index_entry *e, int out_fd) {
+    const struct codec *codec = codec_by_id(INDEX_CODEC(e->flags));
+    if (!codec) {
+        fprintf(stderr, "Неизвестный кодек сжатия: %u\n", INDEX_CODEC(e->flags));
+        return -1;
+    }
+    char *in = malloc(CODEC_BLOCK);
+    char *out = malloc(CODEC_BLOCK);
+    if (!in || !out) {
+        perror("Недостаточно памяти для распаковки");
+        free(in);
+        free(out);
+        return -1;
+    }
+
+    off_t pos = e->offset + sizeof(struct file_header);
+    off_t end = pos + e->size;
+    uint64_t done = 0;
+    int result = 0;
+    while (pos < end) {
+        uint32_t frame;
+        size_t raw = e->file_size - done < CODEC_BLOCK ? e->file_size - done : CODEC_BLOCK;
+        if (end - pos < (off_t)sizeof(frame)
+            || pread(arch->fd, &frame, sizeof(frame), pos) != sizeof(frame)) {
+            result = -1;
+            break;
+        }
+        size_t len = frame & ~CODEC_STORED_BIT;
+        int is_stored = (frame & CODEC_STORED_BIT) != 0;
+        pos += sizeof(frame);
+        if (raw == 0 || len > raw || (is_stored && len != raw) || (off_t)len > end - pos
+            || pread(arch->fd, in, len, pos) != (ssize_t)len
+            || (!is_stored && codec->decompress(in, len, out, raw) == -1)) {
+            result = -1;
+            break;
+        }
+        if (write_all(out_fd, is_stored ? in : out, raw, done) == -1) {
+            perror("Ошибка записи извлекаемого файла");
+            free(in);
+            free(out);
+            return -1;
+        }
+        pos += len;
+        done += raw;
+    }
+    free(in);
+    free(out);
+    if (result == -1 || done != e->file_size) {
+        fprintf(stderr, "Архив повреждён: неверные сжатые данные\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Записать данные записи idx в out_fd; экстенты разреженного файла
+   пишутся по своим смещениям, дыры остаются дырами */
+static int extract_data(const struct archive *arch, long idx, int out_fd) {
+    const struct index_entry *e = &arch->entries[idx];
+    off_t data_off = e->offset + sizeof(struct file_header);
+
+    if (INDEX_CODEC(e->flags) != CODEC_NONE) {
+        return extract_frames(arch, e, out_fd);
+    }
+    if (!(e->flags & INDEX_SPARSE)) {
+        off_t copied = copy_data(arch->fd, data_off, out_fd, 0, e->size);
+        if (copied != (off_t)e->size) {
+            if (copied == -1) perror("Ошибка копирования данных из архива при извлечении");
+            else fprintf(stderr, "Неожиданный EOF при извлечении\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    uint64_t count;
+    if (pread(arch->fd, &count, sizeof(count), data_off) != sizeof(count)
+        || count > e->size / sizeof(struct sparse_extent)) {
+        fprintf(stderr, "Архив повреждён: неверная карта экстентов\n");
+        return -1;
+    }
+    struct sparse_extent *extents = malloc(count ? count * sizeof(*extents) : 1);
+    if (!extents) {
+        perror("Недостаточно памяти для карты экстентов");
+        return -1;
+    }
+    size_t map_size = count * sizeof(*extents);
+    if (pread(arch->fd, extents, map_size, data_off + sizeof(count)) != (ssize_t)map_size) {
+        fprintf(stderr, "Архив повреждён: неверная карта экстентов\n");
+        free(extents);
+        return -1;
+    }
+    if (ftruncate(out_fd, e->file_size) == -1) {
+        perror("Не удалось задать размер извлекаемого файла");
+        free(extents);
+        return -1;
+    }
+
+    off_t pos = data_off + sizeof(count) + map_size;
+    for (uint64_t i = 0; i < count; i++) {
+        off_t copied = copy_data(arch->fd, pos, out_fd, extents[i].offset, extents[i].length);
+        if (copied != (off_t)extents[i].length) {
+            if (copied == -1) perror("Ошибка копирования данных из архива при извлечении");
+            else fprintf(stderr, "Неожиданный EOF при извлечении\n");
+            free(extents);
+            return -1;
         }
+        pos += copied;
     }
+    free(extents);
+    return 0;
+}
 
-    if (!found) {
+void extract_file(const char *archive_name, const char *file_name, int threshold) {
+    struct archive arch;
+    if (archive_open(archive_name, O_RDWR, &arch) == -1) {
+        return;
+    }
+
+    long idx = archive_find(&arch, file_name);
+    if (idx == -1) {
         printf("Файл '%s' не найден в архиве.\n", file_name);
+        archive_close(&arch);
+        return;
     }
 
-    close(arch_fd);
+    struct index_entry *e = &arch.entries[idx];
+    struct file_header header;
+    if (pread(arch.fd, &header, sizeof(header), e->offset) != sizeof(header)
+        || strcmp(header.name, file_name) != 0) {
+        fprintf(stderr, "Ошибка чтения заголовка из архива\n");
+        archive_close(&arch);
+        return;
+    }
+
+    make_parent_dirs(header.name);
+
+    long data_idx = idx;
+    int linked = 0;
+    if (e->flags & INDEX_HARDLINK) {
+        data_idx = archive_link_target(&arch, idx);
+        if (data_idx == -1) {
+            fprintf(stderr, "Архив повреждён: нет исходной записи для жёсткой ссылки '%s'\n", file_name);
+            archive_close(&arch);
+            return;
+        }
+        /* Исходный файл уже извлечён - восстановить именно жёсткую ссылку */
+        const char *target = arch.names + arch.entries[data_idx].name_offset;
+        if ((arch.entries[data_idx].flags & INDEX_DELETED) && strcmp(target, header.name) != 0) {
+            int r = link(target, header.name);
+            if (r == -1 && errno == EEXIST && unlink(header.name) == 0) {
+                r = link(target, header.name);
+            }
+            linked = r == 0;
+        }
+    }
+
+    /* Сжатые кадры и экстенты пишутся потоком с буферами постоянного размера,
+       предел остаётся только для данных без сжатия */
+    const struct index_entry *data = &arch.entries[data_idx];
+    if (!linked && INDEX_CODEC(data->flags) == CODEC_NONE && !(data->flags & INDEX_SPARSE)
+        && header.metadata.st_size > MAX_FILE_SIZE) {
+        printf("Файл '%s' слишком большой для извлечения (размер: %lld байт)\n",
+               file_name, (long long)header.metadata.st_size);
+        archive_close(&arch);
+        return;
+    }
+
+    if (!linked) {
+        int out_fd = open(header.name, O_WRONLY | O_CREAT | O_TRUNC, header.metadata.st_mode);
+        if (out_fd == -1) {
+            perror("Не удалось создать файл для извлечения");
+            archive_close(&arch);
+            return;
+        }
+        if (extract_data(&arch, data_idx, out_fd) == -1) {
+            close(out_fd);
+            archive_close(&arch);
+            return;
+        }
+        close(out_fd);
+    }
+
+    /* Восстановить атрибуты */
+    if (chmod(header.name, header.metadata.st_mode) == -1) {
+        perror("Предупреждение: не удалось восстановить права доступа");
+    }
+    if (chown(header.name, header.metadata.st_uid, header.metadata.st_gid) == -1) {
+        /* Часто не удаётся если не root — это не критично */
+        /* perror("Предупреждение: не удалось восстановить владельца"); */
+    }
+
+    struct utimbuf times = {header.metadata.st_atime, header.metadata.st_mtime};
+    if (utime(header.name, &times) == -1) {
+        perror("Предупреждение: не удалось восстановить время модификации");
+    }
+
+    /* Пометить запись как удалённую в заголовке и в оглавлении; данные
+       остаются на месте до компактации */
+    header.is_deleted = 1;
+    e->flags |= INDEX_DELETED;
+    if (write_all(arch.fd, &header, sizeof(header), e->offset) == -1) {
+        perror("Ошибка записи пометки удаления в архив");
+    } else if (arch.version >= 2) {
+        if (write_all(arch.fd, e, sizeof(*e), arch.data_end + idx * sizeof(*e)) == -1) {
+            perror("Ошибка записи пометки удаления в оглавление");
+        }
+    } else if (arch.version != 0) {
+        /* оглавление старой версии: переписать целиком в текущей */
+        archive_write_index(&arch);
+    }
+
+    printf("Файл '%s' извлечен и удалён из архива.\n", file_name);
+
+    /* Компактация - только когда удалённых данных набралось достаточно */
+    char *live = archive_live_map(&arch);
+    if (live) {
+        off_t dead = archive_dead_bytes(&arch, live);
+        free(live);
+        if (dead > 0 && dead * 100 >= (off_t)threshold * arch.data_end
+            && compact_in_place(&arch) == -1) {
+            fprintf(stderr, "Предупреждение: не удалось сжать архив после удаления. Архив корректно помечен, но размер может остаться прежним.\n");
+        }
+    }
+    archive_close(&arch);
 }
 
+/* Читает только оглавление, к данным не обращается */
 void show_stat(const char *archive_name) {
-    int arch_fd = open(archive_name, O_RDONLY);
-    if (arch_fd == -1) {
-        perror("Не удалось открыть архив");
+    struct archive arch;
+    if (archive_open(archive_name, O_RDONLY, &arch) == -1) {
         return;
     }
 
-    struct file_header header;
-    ssize_t bytes_read;
+    tzset();
     printf("Содержимое архива '%s':\n", archive_name);
-    printf("--------------------------------------------------\n");
-    printf("%-30s %-10s %-20s\n", "Имя файла", "Размер (B)", "Время модификации");
-    printf("--------------------------------------------------\n");
+    printf("---------------------------------------------------------------------\n");
+    printf("%-30s %-10s %-20s %s\n", "Имя файла", "Размер (B)", "Время модификации", "Сжатие");
+    printf("---------------------------------------------------------------------\n");
 
-    while ((bytes_read = read(arch_fd, &header, sizeof(header))) > 0) {
-        if (bytes_read != sizeof(header)) {
-            perror("Ошибка чтения заголовка при просмотре архива");
-            break;
+    off_t total_file = 0, total_stored = 0;
+    int compressed = 0;
+
+    for (size_t i = 0; i < arch.count; i++) {
+        const struct index_entry *e = &arch.entries[i];
+        if (e->flags & INDEX_DELETED) continue;
+
+        char time_buf[80];
+        time_t mtime = e->mtime;
+        struct tm tm_buf;
+        /* localtime_r не перечитывает часовой пояс на каждый вызов */
+        struct tm *tm = localtime_r(&mtime, &tm_buf);
+        if (tm) strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", tm);
+        else strncpy(time_buf, "unknown", sizeof(time_buf));
+
+        /* Сжатие - доля исходного размера, занятая в архиве */
+        char ratio_buf[32] = "-";
+        const struct codec *codec = codec_by_id(INDEX_CODEC(e->flags));
+        if (codec) {
+            snprintf(ratio_buf, sizeof(ratio_buf), "%s %lld%%", codec->name,
+                     (long long)(e->file_size ? e->size * 100 / e->file_size : 100));
+            compressed = 1;
+        } else if (INDEX_CODEC(e->flags) != CODEC_NONE) {
+            snprintf(ratio_buf, sizeof(ratio_buf), "#%u", INDEX_CODEC(e->flags));
         }
-        if (!header.is_deleted) {
-            char time_buf[80];
-            struct tm *tm = localtime(&header.metadata.st_mtime);
-            if (tm) strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", tm);
-            else strncpy(time_buf, "unknown", sizeof(time_buf));
-            printf("%-30s %-10lld %-20s\n", header.name, (long long)header.metadata.st_size, time_buf);
+        printf("%-30s %-10lld %-20s %s\n", arch.names + e->name_offset, (long long)e->file_size,
+               time_buf, ratio_buf);
+        if (!(e->flags & INDEX_HARDLINK)) {
+            total_file += e->file_size;
+            total_stored += e->size;
         }
-        if (lseek(arch_fd, header.metadata.st_size, SEEK_CUR) == -1) {
-            perror("Ошибка позиционирования в архиве при просмотре");
-            break;
+    }
+
+    if (compressed) {
+        printf("---------------------------------------------------------------------\n");
+        printf("Данные: %lld байт, в архиве %lld байт (%lld%%)\n", (long long)total_file,
+               (long long)total_stored, (long long)(total_file ? total_stored * 100 / total_file : 100));
+    }
+
+    char *live = archive_live_map(&arch);
+    if (live) {
+        off_t dead = archive_dead_bytes(&arch, live);
+        if (dead > 0) {
+            printf("---------------------------------------------------------------------\n");
+            printf("Удалено, ожидает компактации: %lld байт (%lld%%)\n", (long long)dead,
+                   (long long)(arch.data_end ? dead * 100 / arch.data_end : 0));
         }
+        free(live);
     }
 
-    close(arch_fd);
+    archive_close(&arch);
 }
 
 
@@ -384,35 +1877,91 @@ int main(int argc, char *argv[]) {
     const char *archive_name = argv[1];
 
     static struct option long_options[] = {
-        {"input",   required_argument, 0, 'i'},
-        {"extract", required_argument, 0, 'e'},
-        {"stat",    no_argument,       0, 's'},
-        {"help",    no_argument,       0, 'h'},
+        {"input",     required_argument, 0, 'i'},
+        {"extract",   required_argument, 0, 'e'},
+        {"stat",      no_argument,       0, 's'},
+        {"compact",   no_argument,       0, 'c'},
+        {"threshold", required_argument, 0, 't'},
+        {"compress",  required_argument, 0, 'z'},
+        {"help",      no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
 
     optind = 2;
     int opt;
     int option_index = 0;
-    opt = getopt_long(argc, argv, "i:e:sh", long_options, &option_index);
+    int action = 0;
+    const char *action_arg = NULL;
+    int threshold = COMPACT_THRESHOLD;
+    const struct codec *codec = NULL;
+
+    /* Путей для -i может быть много: повторные -i и все оставшиеся аргументы */
+    char **paths = malloc(argc * sizeof(*paths));
+    size_t npaths = 0;
+    if (!paths) {
+        perror("Недостаточно памяти");
+        return 1;
+    }
 
-    switch (opt) {
+    while ((opt = getopt_long(argc, argv, "i:e:scht:z:", long_options, &option_index)) != -1) {
+        if (opt == 't') {
+            char *end;
+            long value = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || value < 0 || value > 100) {
+                fprintf(stderr, "Порог компактации должен быть от 0 до 100: %s\n", optarg);
+                free(paths);
+                return 1;
+            }
+            threshold = value;
+            continue;
+        }
+        if (opt == 'z') {
+            codec = codec_by_name(optarg);
+            if (!codec && strcmp(optarg, "none") != 0) {
+                fprintf(stderr, "Неизвестный кодек сжатия: %s (доступны: lz, none)\n", optarg);
+                free(paths);
+                return 1;
+            }
+            continue;
+        }
+        /* Одно действие за запуск; только -i можно повторять */
+        if (opt == '?' || (action != 0 && !(action == 'i' && opt == 'i'))) {
+            print_help();
+            free(paths);
+            return 1;
+        }
+        action = opt;
+        if (opt == 'i') paths[npaths++] = optarg;
+        else action_arg = optarg;
+    }
+    if (action == 'i') {
+        while (optind < argc) {
+            paths[npaths++] = argv[optind++];
+        }
+    }
+
+    int status = 0;
+    switch (action) {
         case 'i':
-            if (optarg) archive_file(archive_name, optarg);
+            if (archive_files(archive_name, paths, npaths, codec) == -1) status = 1;
             break;
         case 'e':
-            if (optarg) extract_file(archive_name, optarg);
+            extract_file(archive_name, action_arg, threshold);
             break;
         case 's':
             show_stat(archive_name);
             break;
+        case 'c':
+            if (compact_archive(archive_name) == -1) status = 1;
+            break;
         case 'h':
             print_help();
             break;
         default:
             print_help();
-            return 1;
+            status = 1;
     }
 
-    return 0;
+    free(paths);
+    return status;
 }
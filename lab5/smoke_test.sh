@@ -0,0 +1,194 @@
+#!/bin/sh
+# Дымовой тест архиватора: оглавление и чтение архивов старого формата,
+# удаление пометкой, компактация, откат прерванной компактации, сжатие -z lz,
+# несколько путей в -i и его код возврата, обход каталогов, жёсткие ссылки
+# и разреженные файлы.
+# Запуск: ./smoke_test.sh [путь/к/archiver]
+
+BIN=$(cd "$(dirname "${1:-./archiver}")" && pwd)/$(basename "${1:-./archiver}")
+HERE=$(cd "$(dirname "$0")" && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+cd "$TMP" || exit 1
+status=0
+
+fail() {
+    echo "FAIL: $1"
+    status=1
+}
+
+size() {
+    stat -c '%s' "$1"
+}
+
+# Извлечь name из архива в каталог out и сравнить с исходником
+extract_same() {
+    mkdir -p out
+    (cd out && "$BIN" "../$1" -t 100 -e "$2" > /dev/null) || fail "$3: -e $2"
+    cmp -s "src/$2" "out/$2" || fail "$3: $2 извлечён с другим содержимым"
+    rm -f "out/$2"
+}
+
+mkdir -p src/d
+i=0
+while [ $i -lt 20 ]; do
+    head -c $((i * 3000 + 1)) /dev/urandom > "src/d/f$i"
+    i=$((i + 1))
+done
+ln src/d/f3 src/d/link3
+(cd src && "$BIN" ../a.arc -i d > /dev/null) || fail "-i"
+
+# Архив с оглавлением: в конце footer, -s читает оглавление, -e находит записи
+[ "$(tail -c 40 a.arc | head -c 8)" = "ARCHIDX1" ] || fail "оглавление: нет footer в конце архива"
+cp a.arc idx.arc
+[ "$("$BIN" idx.arc -s | grep -c '^d/')" -eq 21 ] || fail "оглавление: -s показывает не все записи"
+"$BIN" idx.arc -s | grep -q "^d/f7 *21001 " || fail "оглавление: -s показывает неверный размер"
+extract_same idx.arc d/f7 "оглавление"
+extract_same idx.arc d/f0 "оглавление"
+"$BIN" idx.arc -s | grep -q "^d/f7 " && fail "оглавление: извлечённая запись видна в -s"
+[ "$("$BIN" idx.arc -s | grep -c '^d/')" -eq 19 ] || fail "оглавление: -s после -e"
+
+# Извлечение оставляет только пометку: размер архива не меняется
+before=$(size a.arc)
+for n in 0 1 2 5 8 13; do
+    extract_same a.arc "d/f$n" "пометка"
+done
+[ "$(size a.arc)" -eq "$before" ] || fail "пометка: архив изменил размер без компактации"
+"$BIN" a.arc -s | grep -q "ожидает компактации" || fail "пометка: -s не показывает удалённые данные"
+
+# -c освобождает место, оставшиеся записи извлекаются без изменений
+cp a.arc b.arc
+"$BIN" b.arc -c > /dev/null || fail "-c: код возврата"
+[ "$(size b.arc)" -lt "$before" ] || fail "-c: архив не уменьшился"
+cp b.arc compacted.arc
+"$BIN" b.arc -s | grep -q "ожидает компактации" && fail "-c: удалённые данные остались"
+for n in 3 4 19; do
+    extract_same b.arc "d/f$n" "-c"
+done
+extract_same b.arc d/link3 "-c, жёсткая ссылка"
+
+# С порогом 0 -e сжимает архив сразу
+cp a.arc c.arc
+(mkdir -p out && cd out && "$BIN" ../c.arc -t 0 -e d/f19 > /dev/null) || fail "-t 0: -e"
+rm -f out/d/f19
+[ "$(size c.arc)" -lt "$before" ] || fail "-t 0: архив не уменьшился"
+extract_same c.arc d/f7 "-t 0"
+
+# Прерванная компактация до фиксации журнала откатывается при открытии
+le64() {
+    n=$1
+    k=0
+    while [ $k -lt 8 ]; do
+        printf "\\$(printf '%03o' $((n & 255)))"
+        n=$((n >> 8))
+        k=$((k + 1))
+    done
+}
+cp a.arc j.arc
+{
+    head -c 4096 /dev/urandom
+    printf 'ARCHJRN1\003\000\000\000\000\000\000\000'
+    le64 "$before"
+    le64 0
+    le64 0
+} >> j.arc
+"$BIN" j.arc -s 2>&1 | grep -q "прервана" || fail "журнал: -s открыл незавершённый архив"
+"$BIN" j.arc -c > /dev/null 2>&1 || fail "журнал: -c не восстановил архив"
+cmp -s j.arc compacted.arc || fail "журнал: после отката и -c архив отличается"
+extract_same j.arc d/f4 "журнал"
+
+# Сжатие: хорошо сжимаемый файл сжимается, несжимаемый хранится как есть,
+# оба извлекаются без изменений, в том числе после компактации
+mkdir -p src/z
+i=0
+while [ $i -lt 20000 ]; do
+    echo "2025-10-12 15:30:45 INFO request $i served in $((i % 97)) ms"
+    i=$((i + 1))
+done > src/z/app.log
+head -c 300000 /dev/urandom > src/z/random.bin
+(cd src && "$BIN" ../z.arc -z lz -i z > /dev/null) || fail "-z lz: -i"
+"$BIN" z.arc -s | grep -q "^z/app.log .* lz " || fail "-z lz: лог не сжат"
+"$BIN" z.arc -s | grep -q "^z/random.bin .* -$" || fail "-z lz: несжимаемый файл не хранится как есть"
+[ "$(size z.arc)" -lt $(($(size src/z/app.log) / 2 + 300000 + 4096)) ] || fail "-z lz: архив не уменьшился"
+cp z.arc z2.arc
+extract_same z.arc z/app.log "-z lz"
+extract_same z.arc z/random.bin "-z lz"
+(mkdir -p out && cd out && "$BIN" ../z2.arc -t 0 -e z/random.bin > /dev/null) || fail "-z lz, -t 0: -e"
+rm -f out/z/random.bin
+extract_same z2.arc z/app.log "-z lz после компактации"
+
+# Несколько путей в -i: каталоги обходятся рекурсивно, файл, который не
+# удалось добавить, даёт код возврата 1, остальные всё равно попадают в архив
+mkdir -p src/m/sub
+echo one > src/m/one
+echo two > src/m/sub/two
+echo three > src/three
+(cd src && "$BIN" ../m.arc -i m three > /dev/null) || fail "-i: код возврата при успехе"
+(cd src && "$BIN" ../m.arc -i missing three > /dev/null 2>&1) && fail "-i: код возврата 0 при отсутствующем файле"
+[ "$("$BIN" m.arc -s | grep -c '^m/\|^three ')" -eq 4 ] || fail "-i: в архиве не все файлы"
+extract_same m.arc m/sub/two "-i"
+extract_same m.arc three "-i"
+
+# Обход каталогов, жёсткая ссылка хранится один раз, разреженный файл
+# сохраняет дыры; ссылка, извлечённая после источника и компактации,
+# становится настоящей ссылкой
+mkdir -p src/h/one/two
+head -c 200000 /dev/urandom > src/h/one/target
+ln src/h/one/target src/h/one/two/link
+echo deep > src/h/one/two/deep
+printf 'start' > src/h/sparse
+truncate -s 50M src/h/sparse
+printf 'end' >> src/h/sparse
+(cd src && "$BIN" ../h.arc -i h > /dev/null) || fail "-i каталога"
+for n in h/one/target h/one/two/link h/one/two/deep h/sparse; do
+    "$BIN" h.arc -s | grep -q "^$n " || fail "-i каталога: нет $n"
+done
+[ "$(size h.arc)" -lt 400000 ] || fail "жёсткая ссылка или разреженный файл хранятся целиком"
+cp h.arc h2.arc
+
+mkdir -p out
+(cd out && "$BIN" ../h.arc -t 100 -e h/sparse > /dev/null) || fail "разреженный файл: -e"
+cmp -s src/h/sparse out/h/sparse || fail "разреженный файл извлечён с другим содержимым"
+[ "$(stat -c '%b' out/h/sparse)" -lt 1024 ] || fail "разреженный файл извлечён без дыр"
+(cd out && "$BIN" ../h.arc -t 100 -e h/one/target > /dev/null) || fail "жёсткая ссылка: -e источника"
+"$BIN" h.arc -c > /dev/null || fail "жёсткая ссылка: -c"
+(cd out && "$BIN" ../h.arc -t 100 -e h/one/two/link > /dev/null) || fail "жёсткая ссылка: -e после -c"
+cmp -s src/h/one/target out/h/one/two/link || fail "жёсткая ссылка извлечена с другим содержимым"
+[ "$(stat -c '%i' out/h/one/target)" = "$(stat -c '%i' out/h/one/two/link)" ] \
+    || fail "жёсткая ссылка после источника извлечена копией"
+extract_same h.arc h/one/two/deep "обход каталогов"
+rm -rf out/h
+
+# Ссылка раньше источника извлекается независимой копией
+extract_same h2.arc h/one/two/link "жёсткая ссылка раньше источника"
+extract_same h2.arc h/one/target "жёсткая ссылка раньше источника"
+
+# Архив, созданный исходной версией архиватора (первый коммит репозитория,
+# формат без оглавления): новая версия его читает, извлекает и дописывает
+if OLD_SRC=$(git -C "$HERE" show "$(git -C "$HERE" rev-list --max-parents=0 HEAD):lab5/main.c" 2> /dev/null) \
+    && printf '%s\n' "$OLD_SRC" | ${CC:-cc} -w -x c -o old_archiver - 2> /dev/null; then
+    mkdir -p src/v0
+    echo first > src/v0/a
+    head -c 70000 /dev/urandom > src/v0/b
+    echo third > src/v0/c
+    for n in a b c; do
+        (cd src && ../old_archiver ../v0.arc -i "v0/$n" > /dev/null)
+    done
+    (mkdir -p old/v0 && cd old && ../old_archiver ../v0.arc -e v0/b > /dev/null)
+    cmp -s src/v0/b old/v0/b || fail "старый формат: исходная версия не извлекла запись"
+    [ "$(tail -c 40 v0.arc | head -c 8)" = "ARCHIDX1" ] && fail "старый формат: у архива уже есть оглавление"
+    "$BIN" v0.arc -s | grep -q "^v0/c " || fail "старый формат: -s не видит записи"
+    "$BIN" v0.arc -s | grep -q "^v0/b " && fail "старый формат: -s видит удалённую запись"
+    extract_same v0.arc v0/a "старый формат"
+    echo fourth > src/v0/d
+    (cd src && "$BIN" ../v0.arc -i v0/d > /dev/null) || fail "старый формат: -i"
+    [ "$(tail -c 40 v0.arc | head -c 8)" = "ARCHIDX1" ] || fail "старый формат: -i не дописал оглавление"
+    [ "$("$BIN" v0.arc -s | grep -c '^v0/')" -eq 2 ] || fail "старый формат: -s после -i"
+    extract_same v0.arc v0/c "старый формат"
+    extract_same v0.arc v0/d "старый формат"
+else
+    echo "пропуск: исходная версия архиватора недоступна (нужны git и cc)"
+fi
+
+[ $status -eq 0 ] && echo "index, compact, compress, input: OK"
+exit $status